@@ -38,6 +38,14 @@
 #ifndef _CRC16_H_
 #define _CRC16_H_
 
+#include <stdint.h>
+
+/* Slicing-by-8 needs an extra 3.5KiB of tables - define ZCRC_SMALL (or	*/
+/* ZEMBEDDED) to stick with the single table, one byte per lookup		*/
+#if !defined(ZCRC_SMALL) && !defined(ZEMBEDDED) && !defined(ZCRC_SLICE8)
+#define ZCRC_SLICE8
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,6 +54,9 @@ extern unsigned short crc16tbl[];
 
 unsigned short crc16(char *data, unsigned long len);
 
+/* Update a running CRC-16 with len bytes from buf							*/
+uint16_t crc16_update(uint16_t crc, const uint8_t* buf, unsigned long len);
+
 #ifdef __cplusplus
 }
 #endif
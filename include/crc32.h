@@ -38,14 +38,25 @@
 #ifndef _CRC32_H_
 #define _CRC32_H_
 
+#include <stdint.h>
+
+/* Slicing-by-8 needs an extra 7KiB of tables - define ZCRC_SMALL (or	*/
+/* ZEMBEDDED) to stick with the single table, one byte per lookup		*/
+#if !defined(ZCRC_SMALL) && !defined(ZEMBEDDED) && !defined(ZCRC_SLICE8)
+#define ZCRC_SLICE8
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern long crc32tbl[];
+extern uint32_t crc32tbl[];
 
 unsigned long crc32i(unsigned long crc, char* buf, unsigned long len);
 
+/* Update a running (non-inverted) CRC-32 with len bytes from buf			*/
+uint32_t crc32_update(uint32_t crc, const uint8_t* buf, unsigned long len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,60 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Bulk CRC routines with runtime CPU dispatch
+ * ------------------------------------------------------------
+ */
+
+#ifndef __ROSCO_M68K_ZCRC_H
+#define __ROSCO_M68K_ZCRC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * On x86-64 hosts, long buffers are folded with PCLMULQDQ if the CPU
+ * has it. Define ZCRC_NO_CLMUL to always use the table code.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(ZEMBEDDED) && !defined(ZCRC_NO_CLMUL)
+#define ZCRC_CLMUL
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Update a running CRC with len bytes from buf, using the fastest
+ * implementation available on this CPU. The CRC is not inverted on
+ * the way in or out (i.e. same semantics as crc32_update / crc16_update).
+ */
+uint32_t zm_crc32_update(uint32_t crc, const uint8_t *buf, unsigned long len);
+uint16_t zm_crc16_update(uint16_t crc, const uint8_t *buf, unsigned long len);
+
+/*
+ * True if the carry-less multiply versions are in use.
+ */
+bool zm_crc_have_clmul();
+
+#ifdef ZCRC_CLMUL
+/*
+ * Carry-less multiply versions. Only call these if zm_crc_have_clmul()
+ * is true!
+ */
+uint32_t zm_crc32_clmul(uint32_t crc, const uint8_t *buf, unsigned long len);
+uint16_t zm_crc16_clmul(uint16_t crc, const uint8_t *buf, unsigned long len);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ROSCO_M68K_ZCRC_H */
@@ -0,0 +1,61 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * ZDLE escaping for outgoing data
+ * ------------------------------------------------------------
+ */
+
+#ifndef __ROSCO_M68K_ZESCAPE_H
+#define __ROSCO_M68K_ZESCAPE_H
+
+#include <stdint.h>
+#include "ztypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Most bytes zm_escape_ctx can write for len input bytes. If the output
+ * buffer is at least this big, it never needs to check for space.
+ */
+#define ZESCAPED_MAX(len)   ((len) * 2)
+
+/*
+ * (Re)build the session's escape table from the receiver's ZRINIT
+ * flags in ctx->rx_caps. zm_init_ctx and zm_sender_begin call this,
+ * so you only need to if you change rx_caps yourself.
+ *
+ * ZDLE, DLE, XON and XOFF (and their high-bit versions) are always
+ * escaped, as is CR after '@' (for telenet). With ESCCTL, all control
+ * characters are. With ESC8, so are 0x7f and 0xff (as ZRUB0 / ZRUB1).
+ */
+void zm_escape_init_ctx(ZMCTX *ctx);
+
+/*
+ * Escape len bytes from in to out, returning the number of bytes
+ * written (at most ZESCAPED_MAX(len)).
+ */
+uint16_t zm_escape_ctx(ZMCTX *ctx, const uint8_t *in, uint16_t len, uint8_t *out);
+
+/*
+ * Same as zm_escape_ctx, but also updates a running CRC with the
+ * (unescaped) bytes in the same pass - CRC32 if the receiver said
+ * CANFC32, otherwise CRC16. As with zm_crc*_update, the CRC isn't
+ * inverted on the way in or out.
+ */
+uint16_t zm_escape_crc_ctx(ZMCTX *ctx, const uint8_t *in, uint16_t len, uint8_t *out, uint32_t *crc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ROSCO_M68K_ZESCAPE_H */
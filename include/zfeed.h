@@ -0,0 +1,85 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Push-style (non-blocking) receive parser
+ * ------------------------------------------------------------
+ */
+
+#ifndef __ROSCO_M68K_ZFEED_H
+#define __ROSCO_M68K_ZFEED_H
+
+#include <stdint.h>
+#include "ztypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Events returned by zm_feed_ctx
+#define ZEV_NONE          0x00          /* All input consumed, nothing to report yet        */
+#define ZEV_HEADER        0x01          /* Header complete - see hdr and result             */
+#define ZEV_DATA          0x02          /* Data subpacket complete - see len and result     */
+#define ZEV_CANCEL        0x03          /* 5x CAN received                                  */
+
+typedef struct {
+  uint8_t   type;           /* One of ZEV_xxx                                           */
+  ZRESULT   result;         /* ZEV_HEADER: OK, or the error (BAD_CRC etc)               */
+                            /* ZEV_DATA: GOT_CRCx, or BAD_CRC / BAD_ESCAPE / OUT_OF_SPACE */
+  ZHDR      hdr;            /* ZEV_HEADER: the header                                   */
+  uint16_t  len;            /* ZEV_DATA: bytes in the data buffer (incl. frame end)     */
+} ZEVENT;
+
+/*
+ * The functions in zserial.h pull bytes through the transport hooks and
+ * block until they have what they need. These are the other way around -
+ * you push whatever bytes you have, whenever you have them, and get
+ * events back. Useful with select / epoll and friends, where one thread
+ * might be looking after a lot of links.
+ *
+ * These only work on a session (there's no point otherwise), and
+ * don't touch its transport hooks - use the _ctx send functions in
+ * zserial.h to reply.
+ */
+
+/*
+ * Set up the parser in the given session. Data subpackets are
+ * collected in data_buf, which must stay valid for the life of
+ * the session (data_len should be at least 1025 bytes).
+ */
+void zm_feed_init_ctx(ZMCTX *ctx, uint8_t *data_buf, uint16_t data_len);
+
+/*
+ * Throw away any partial header / subpacket and go back to looking for
+ * the next header (e.g. after sending ZRPOS in response to a bad one).
+ */
+void zm_feed_reset_ctx(ZMCTX *ctx);
+
+/*
+ * Consume bytes until either an event occurs or they're all gone.
+ *
+ * len specifies the number of bytes available on entry, and contains
+ * the number actually consumed on return. If an event is returned, call
+ * again with the rest of the bytes to carry on.
+ *
+ * Returns the event type (also in ev->type). For ZEV_DATA, the
+ * subpacket is in the data buffer passed to zm_feed_init_ctx and is
+ * only valid until the next call.
+ *
+ * Data subpackets are expected after any valid ZSINIT, ZFILE, ZDATA,
+ * ZCOMMAND or ZSTDERR header, until one ends with ZCRCE or ZCRCW.
+ */
+uint8_t zm_feed_ctx(ZMCTX *ctx, const uint8_t *bytes, uint16_t *len, ZEVENT *ev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ROSCO_M68K_ZFEED_H */
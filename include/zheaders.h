@@ -29,6 +29,11 @@ extern "C" {
  */
 void zm_calc_hdr_crc(ZHDR *hdr);
 
+/*
+ * As above, but CRC32 (for ZBIN32 headers) - sets crc1 to crc4.
+ */
+void zm_calc_hdr_crc32(ZHDR *hdr);
+
 uint16_t zm_calc_data_crc(uint8_t *buf, uint16_t len);
 uint32_t zm_calc_data_crc32(uint8_t *buf, uint16_t len);
 
@@ -48,6 +53,13 @@ ZRESULT zm_to_hex_header(ZHDR *hdr, uint8_t *buf, int max_len);
 ZRESULT zm_check_header_crc16(ZHDR *hdr, uint16_t crc);
 ZRESULT zm_check_header_crc32(ZHDR *hdr, uint32_t crc);
 
+/*
+ * Parse ZFILE block 0 (as returned by zm_read_data_block - len includes
+ * the frame end). Returns CORRUPTED if the name isn't terminated, or
+ * OUT_OF_RANGE if a number won't fit.
+ */
+ZRESULT zm_parse_file_info(uint8_t *buf, uint16_t len, ZFILEINFO *info);
+
 #ifdef ZDEBUG
 /* this is wasteful, but only if debugging is on, so, y'know... */
 static char *__hdrtypes[] __attribute__((unused)) = {
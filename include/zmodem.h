@@ -20,5 +20,7 @@
 #include "znumbers.h"
 #include "zheaders.h"
 #include "zserial.h"
+#include "zfeed.h"
+#include "zsender.h"
 
 #endif /* __ROSCO_M68K_ZMODEM_H */
@@ -0,0 +1,63 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Bulk scanning routines for buffered receive
+ * ------------------------------------------------------------
+ */
+
+#ifndef __ROSCO_M68K_ZSCAN_H
+#define __ROSCO_M68K_ZSCAN_H
+
+#include <stdint.h>
+
+/*
+ * On x86-64 hosts, scans use SSE2 (or AVX2, if the CPU has it).
+ * Define ZSCAN_NO_SIMD to always use the plain C version.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(ZEMBEDDED) && !defined(ZSCAN_NO_SIMD)
+#define ZSCAN_SIMD
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns the number of bytes at the start of buf that zm_read_escaped
+ * would return unchanged, i.e. the offset of the first ZDLE, XON or XOFF
+ * (or len, if there are none).
+ */
+uint16_t zm_scan_unescaped(const uint8_t *buf, uint16_t len);
+
+#ifdef ZSCAN_SIMD
+#define ZSCAN_SCALAR    0
+#define ZSCAN_SSE2      1
+#define ZSCAN_AVX2      2
+
+/*
+ * Pick the version zm_scan_unescaped uses (e.g. to test them all), up
+ * to the best the CPU has - which is what it starts on. Returns the
+ * one it ends up with.
+ */
+uint8_t zm_scan_level(uint8_t level);
+#endif
+
+/*
+ * Returns the offset of the first ZDLE in buf (or len, if there isn't
+ * one) - i.e. how much can be skipped when looking for a header.
+ */
+uint16_t zm_scan_zdle(const uint8_t *buf, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ROSCO_M68K_ZSCAN_H */
@@ -0,0 +1,110 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Sending side of the Zmodem implementation
+ * ------------------------------------------------------------
+ */
+
+#ifndef __ROSCO_M68K_ZSENDER_H
+#define __ROSCO_M68K_ZSENDER_H
+
+#include <stdint.h>
+#include "ztypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where the sender gets file data from. Called with the file offset
+ * to read from, and the maximum length in len. Should set len to
+ * the number of bytes actually read (0 at end of file). The source
+ * pointer passed to zm_send_file is passed straight through.
+ *
+ * Reads aren't always sequential - after a ZRPOS the sender will
+ * go back to wherever the receiver asked for.
+ */
+typedef ZRESULT (*ZREADFN)(void *source, uint32_t offset, uint8_t *buf, uint16_t *len);
+
+/*
+ * Start a session - sends "rz\r" and ZRQINIT, and waits for the
+ * receiver's ZRINIT. Its capabilities are kept in the session (e.g.
+ * CRC32 is used if the receiver says CANFC32).
+ *
+ * Subpackets are ZDATA_BLOCK_LEN bytes, or ZBIG_BLOCK_LEN if the
+ * receiver sets CAN8K in ZRINIT F1 (most receivers expect no more
+ * than 1K, so it has to ask). Set ctx->block_max first to cap them.
+ *
+ * That's only where they start - the size in use is halved (down to
+ * ZMIN_BLOCK_LEN) each time the receiver asks for a resend or sends
+ * ZNAK, and doubled again after ZGROW_AFTER clean subpackets. How
+ * that's going (and the current size) is in ctx->stats, which is
+ * reset here.
+ */
+ZRESULT zm_sender_begin();
+ZRESULT zm_sender_begin_ctx(ZMCTX *ctx);
+
+/*
+ * Send one file. size is the total file size, which is sent to the
+ * receiver in block 0 along with the name.
+ *
+ * Returns OK once the receiver has acknowledged ZEOF, or SKIPPED if
+ * it didn't want the file. Any ZRPOS the receiver sends is honoured
+ * by going back and streaming again from the requested position. With
+ * a peek hook in the session that happens as soon as it arrives;
+ * without one, only when the sender next stops to wait (for the
+ * window, or after ZEOF).
+ *
+ * The ZFILE conversion option comes from ctx->file_conv (ZCBIN if it's
+ * 0) - set it to ZCRESUM to ask the receiver to carry on from whatever
+ * it already has. If the receiver asks for a ZCRC of the file first,
+ * it's answered from read / data (up to ZSEND_STRAYS times, then it's
+ * BAD_FRAME_TYPE).
+ */
+ZRESULT zm_send_file(const char *name, uint32_t size, ZREADFN read, void *source);
+ZRESULT zm_send_file_ctx(ZMCTX *ctx, const char *name, uint32_t size, ZREADFN read, void *source);
+
+/*
+ * Same as zm_send_file, but for a file that's already in memory (e.g.
+ * in ROM, or mmap'd). Subpackets are escaped straight from data, so
+ * nothing is copied and going back after ZRPOS costs nothing.
+ */
+ZRESULT zm_send_mem(const char *name, const uint8_t *data, uint32_t size);
+ZRESULT zm_send_mem_ctx(ZMCTX *ctx, const char *name, const uint8_t *data, uint32_t size);
+
+/*
+ * Windowed sending. With a window, subpackets end with ZCRCQ every
+ * window / 4 bytes, and the sender carries on while the ZACKs come
+ * back, only stopping to wait for them when more than window bytes
+ * are unacknowledged. A ZRPOS seen while waiting takes effect straight
+ * away, rather than at ZEOF. Window 0 (the default) streams the whole
+ * file without waiting.
+ *
+ * If ring is given (zm_send_file only), the last ring_len bytes read
+ * from the file are kept in it, so going back after ZRPOS resends
+ * from there rather than reading the file again. Make it at least
+ * window bytes to cover the whole window. It needs to stay around for
+ * as long as the session does.
+ */
+void zm_sender_window(uint32_t window, uint8_t *ring, uint32_t ring_len);
+void zm_sender_window_ctx(ZMCTX *ctx, uint32_t window, uint8_t *ring, uint32_t ring_len);
+
+/*
+ * End the session - ZFIN exchange followed by "OO".
+ */
+ZRESULT zm_sender_end();
+ZRESULT zm_sender_end_ctx(ZMCTX *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ROSCO_M68K_ZSENDER_H */
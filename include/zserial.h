@@ -26,39 +26,145 @@ extern "C" {
 
 #define NONCONTROL(c)    ((bool)((uint8_t)(c & 0xe0)))
 
+#ifdef ZBUFFERED
+/*
+ * The lib doesn't implement these - they need to be provided.
+ *
+ * When built with ZBUFFERED, the library talks to the link a block
+ * at a time rather than a byte at a time. It keeps its own receive
+ * window (ZRECV_WIN_LEN bytes) and refills it with zm_recv_buf, and
+ * whole headers are handed to zm_send_buf in a single call.
+ *
+ * For zm_recv_buf, len specifies the maximum length to read on entry,
+ * and must contain the actual length on return. It should block until
+ * at least one byte is available (returning zero bytes is treated as
+ * CLOSED).
+ */
+ZRESULT zm_recv_buf(uint8_t *buf, uint16_t *len);
+ZRESULT zm_send_buf(const uint8_t *buf, uint16_t len);
+#else
 /*
  * The lib doesn't implement these - they need to be provided.
  */
 ZRESULT zm_recv();
 ZRESULT zm_send(uint8_t chr);
+#endif
+
+/*
+ * Initialise a session context (see ZMCTX in ztypes.h).
+ *
+ * Every function below comes in two flavours - the plain one works on
+ * a single, library-owned session that uses the hooks above, while
+ * the _ctx version works on the session you pass in.
+ */
+void zm_init_ctx(ZMCTX *ctx);
+
+/*
+ * The session used by the non-_ctx functions.
+ */
+ZMCTX* zm_default_ctx();
+
+/*
+ * Discard any input the library has buffered but not yet consumed.
+ * Does nothing unless built with ZBUFFERED.
+ */
+void zm_purge();
+void zm_purge_ctx(ZMCTX *ctx);
 
 /*
  * Receive CR/LF (with CR being optional).
  */
 ZRESULT zm_read_crlf();
+ZRESULT zm_read_crlf_ctx(ZMCTX *ctx);
 
 /*
  * Read two ASCII characters and convert them from hex.
  */
 ZRESULT zm_read_hex_byte();
+ZRESULT zm_read_hex_byte_ctx(ZMCTX *ctx);
 
 /*
  * Read character, taking care of ZMODEM Data Link Escapes (ZDLE)
  * and swallowing XON/XOFF.
  */
 ZRESULT zm_read_escaped();
+ZRESULT zm_read_escaped_ctx(ZMCTX *ctx);
 
 /*
  * buf must be one character longer than the string...
  * Trashes buf, for obvious reasons.
  */
 ZRESULT zm_await(char *str, char *buf, int buf_size);
+ZRESULT zm_await_ctx(ZMCTX *ctx, char *str, char *buf, int buf_size);
+
+/*
+ * Wait for a ZDLE / a header, skipping anything else. If the session's
+ * garbage_max is set, give up with TOO_MUCH_GARBAGE once more than that
+ * many bytes have been skipped in one wait (ZPADs and bad frame types
+ * count, so allow a few). Calling again carries on from there.
+ */
 ZRESULT zm_await_zdle();
+ZRESULT zm_await_zdle_ctx(ZMCTX *ctx);
 ZRESULT zm_await_header(ZHDR *hdr);
+ZRESULT zm_await_header_ctx(ZMCTX *ctx, ZHDR *hdr);
+
+/*
+ * Like zm_await_header, but only if the other end has started sending
+ * one - needs the session's peek hook. Junk before it is skipped (XON /
+ * XOFF are noted) until there's nothing more waiting, and then it
+ * returns TIMEOUT without blocking (as it always does with no hook).
+ */
+ZRESULT zm_poll_header(ZHDR *hdr);
+ZRESULT zm_poll_header_ctx(ZMCTX *ctx, ZHDR *hdr);
+
+/*
+ * Transport hooks can return TIMEOUT when nothing arrives for a while,
+ * and the read functions pass it back up. When the receiver gets one,
+ * call this - it resends the last ZRINIT or ZRPOS sent (not whatever
+ * was sent since, e.g. ZACK or ZNAK) after 1, 2, 4, 8... timeouts in
+ * a row, and returns TIMEOUT to say give up
+ * once there have been more than ctx->timeout_budget (ZTIMEOUT_BUDGET
+ * if that's 0). Getting a valid header starts the count again.
+ */
+ZRESULT zm_timeout();
+ZRESULT zm_timeout_ctx(ZMCTX *ctx);
+
+/*
+ * Call after getting a ZSINIT header (in hdr) to read its data - the
+ * sender's Attn sequence, which is kept in the session - and ACK it.
+ * The escaping asked for in ZF0 (TESCCTL / TESC8) is used for anything
+ * sent back from then on.
+ */
+ZRESULT zm_read_zsinit(ZHDR *hdr);
+ZRESULT zm_read_zsinit_ctx(ZMCTX *ctx, ZHDR *hdr);
+
+/*
+ * Send the sender's Attn sequence (from ZSINIT), if it gave one, to
+ * interrupt it. ATTNBRK / ATTNPSE go to the session's attn_sig hook
+ * (and are skipped without one). zm_resync does this before ZRPOS.
+ */
+ZRESULT zm_send_attn();
+ZRESULT zm_send_attn_ctx(ZMCTX *ctx);
+
+/*
+ * Recover after a bad data subpacket (or header) while receiving: sends
+ * the sender's Attn (see zm_send_attn) and a single ZRPOS for pos, then
+ * quietly skips the rest of the sender's frame - only ZPAD ZDLE is
+ * looked at, garbled headers get no reply and ZDATA or ZEOF for
+ * anywhere but pos is ignored.
+ *
+ * Returns OK with the next header that's worth acting on in hdr
+ * (normally ZDATA at pos), or an error (CANCELLED / CLOSED).
+ */
+ZRESULT zm_resync(uint32_t pos, ZHDR *hdr);
+ZRESULT zm_resync_ctx(ZMCTX *ctx, uint32_t pos, ZHDR *hdr);
 
 ZRESULT zm_read_hex_header(ZHDR *hdr);
+ZRESULT zm_read_hex_header_ctx(ZMCTX *ctx, ZHDR *hdr);
 ZRESULT zm_read_binary16_header(ZHDR *hdr);
+ZRESULT zm_read_binary16_header_ctx(ZMCTX *ctx, ZHDR *hdr);
 ZRESULT zm_read_binary32_header(ZHDR *hdr);
+ZRESULT zm_read_binary32_header_ctx(ZMCTX *ctx, ZHDR *hdr);
 
 
 /*
@@ -66,26 +172,64 @@ ZRESULT zm_read_binary32_header(ZHDR *hdr);
  * and contains actual length on return.
  */
 ZRESULT zm_read_data_block(uint8_t *buf, uint16_t *len);
+ZRESULT zm_read_data_block_ctx(ZMCTX *ctx, uint8_t *buf, uint16_t *len);
 
 /*
  * Send a null-terminated string.
  */
 ZRESULT zm_send_sz(uint8_t *data);
+ZRESULT zm_send_sz_ctx(ZMCTX *ctx, uint8_t *data);
+
+ZRESULT zm_send_raw(const uint8_t *buf, uint16_t len);
+ZRESULT zm_send_raw_ctx(ZMCTX *ctx, const uint8_t *buf, uint16_t len);
 
 /*
  * Send the given header as hex, with ZPAD/ZDLE preamble.
  */
 ZRESULT zm_send_hex_hdr(ZHDR *hdr);
+ZRESULT zm_send_hex_hdr_ctx(ZMCTX *ctx, ZHDR *hdr);
+
+/*
+ * Send the given header as binary (ZBIN16 or ZBIN32), with ZPAD/ZDLE
+ * preamble. The CRC is calculated here, so only type and flags /
+ * position need to be filled in. Only use these once the other end is
+ * known to take binary headers.
+ */
+ZRESULT zm_send_bin16_hdr(ZHDR *hdr);
+ZRESULT zm_send_bin16_hdr_ctx(ZMCTX *ctx, ZHDR *hdr);
+ZRESULT zm_send_bin32_hdr(ZHDR *hdr);
+ZRESULT zm_send_bin32_hdr_ctx(ZMCTX *ctx, ZHDR *hdr);
 
 /*
- * Convenience function to build and send a position header as hex.
+ * Send the given header in the shortest form the other end has shown
+ * it handles - ZBIN32 or ZBIN16 once zm_await_header has had one of
+ * those from it, hex until then.
+ */
+ZRESULT zm_send_hdr(ZHDR *hdr);
+ZRESULT zm_send_hdr_ctx(ZMCTX *ctx, ZHDR *hdr);
+
+/*
+ * Convenience function to build and send a position header (see
+ * zm_send_hdr for the format).
  */
 ZRESULT zm_send_pos_hdr(uint8_t type, uint32_t pos);
+ZRESULT zm_send_pos_hdr_ctx(ZMCTX *ctx, uint8_t type, uint32_t pos);
 
 /*
- * Convenience function to build and send a flags header as hex.
+ * Convenience function to build and send a flags header (see
+ * zm_send_hdr for the format).
  */
 ZRESULT zm_send_flags_hdr(uint8_t type, uint8_t f0, uint8_t f1, uint8_t f2, uint8_t f3);
+ZRESULT zm_send_flags_hdr_ctx(ZMCTX *ctx, uint8_t type, uint8_t f0, uint8_t f1, uint8_t f2, uint8_t f3);
+
+/*
+ * Send ZRINIT with the given capability flags (ZF0 / ZF1) and the
+ * size of the receive buffer in ZP0 / ZP1. A sender will wait for
+ * a ZACK (ZCRCW) at least every buf_len bytes - use 0 if the receiver
+ * can take data at full speed.
+ */
+ZRESULT zm_send_zrinit(uint8_t flags, uint8_t flags1, uint16_t buf_len);
+ZRESULT zm_send_zrinit_ctx(ZMCTX *ctx, uint8_t flags, uint8_t flags1, uint16_t buf_len);
 
 #ifdef __cplusplus
 }
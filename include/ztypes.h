@@ -78,6 +78,17 @@ extern "C" {
 #define ESCCTL      0x40                /* Receiver expects ctl chars to be escaped         */
 #define ESC8        0x80                /* Receiver expects 8th bit to be escaped           */
 
+// Capabilities for ZRINIT (F1)
+#define CAN8K       0x80                /* Rx takes ZBIG_BLOCK_LEN subpackets (not in spec) */
+
+// ZSINIT flags (F0)
+#define TESCCTL     0x40                /* Tx expects ctl chars to be escaped               */
+#define TESC8       0x80                /* Tx expects 8th bit to be escaped                 */
+
+// Attn sequence escapes (ZSINIT)
+#define ATTNBRK     0xdd                /* Send a break signal                              */
+#define ATTNPSE     0xde                /* Pause for one second                             */
+
 // ZFILE conversion options (F0)
 #define ZCBIN       0x01                /* Binary transfer - inhibit conversion             */
 #define ZCNL        0x02                /* Convert NL to local end of line convention       */
@@ -94,6 +105,7 @@ extern "C" {
 #define GOT_CRCG          (FIN | ZCRCG) /* CRC follows, frame continues (non-stop)          */
 #define GOT_CRCQ          (FIN | ZCRCQ) /* CRC follows, frame continues, ZACK expected      */
 #define GOT_CRCW          (FIN | ZCRCW) /* CRC follows, end of frame, ZACK expected         */
+#define SKIPPED           0x0300        /* Receiver doesn't want this file (ZSKIP)          */
 
 // ZRESULT codes - Errors
 #define BAD_DIGIT         0x1000        /* Bad digit when converting from hex               */
@@ -106,6 +118,8 @@ extern "C" {
 #define OUT_OF_SPACE      0x8000        /* Supplied buffer is not big enough                */
 #define CANCELLED         0x9000        /* 5x CAN received                                  */
 #define BAD_ESCAPE        0xa000        /* Bad escape sequence                              */
+#define TIMEOUT           0xb000        /* Nothing received in time (from transport hooks)  */
+#define TOO_MUCH_GARBAGE  0xc000        /* More than garbage_max junk bytes before a header */
 #define UNSUPPORTED       0xf000        /* Attempted to use an unsupported protocol feature */
 
 #define ERROR_CODE(x)     (x & ERROR_MASK)
@@ -146,6 +160,40 @@ extern "C" {
 // Various sizes
 #define ZHDR_SIZE         0x09                  /* Size of ZHDR (excluding padding)         */
 #define HEX_HDR_STR_LEN   0x11                  /* Total size of a ZHDR encoded as hex      */
+#define HEX_HDR_FRAME_LEN 0x15                  /* Hex header with ZPAD/ZDLE and XON        */
+
+#define ZDATA_BLOCK_LEN   0x400                 /* Data subpacket size used when sending    */
+#define ZBIG_BLOCK_LEN    0x2000                /* Subpacket size if receiver says CAN8K    */
+
+#define ZSEND_BUF_LEN     (ZDATA_BLOCK_LEN * 2 + 10)    /* Worst-case escaped subpacket     */
+
+#ifndef ZMIN_BLOCK_LEN
+#define ZMIN_BLOCK_LEN    0x20                  /* Sender won't shrink subpackets below     */
+#endif
+
+#ifndef ZGROW_AFTER
+#define ZGROW_AFTER       0x10                  /* Clean subpackets before sender grows     */
+#endif
+
+#define ZATTNLEN          0x20                  /* Most Attn bytes (ZSINIT), with the NUL   */
+
+#define ZSTATS_HISTORY    8                     /* Subpacket size changes kept in ZSTATS    */
+
+#ifndef ZSEND_RETRIES
+#define ZSEND_RETRIES     10                    /* Times sender repeats a header            */
+#endif
+
+#ifndef ZSEND_STRAYS
+#define ZSEND_STRAYS      0x20                  /* Replies sender answers without progress  */
+#endif
+
+#ifndef ZTIMEOUT_BUDGET
+#define ZTIMEOUT_BUDGET   32                    /* Timeouts in a row before giving up       */
+#endif
+
+#ifndef ZRECV_WIN_LEN
+#define ZRECV_WIN_LEN     0x400                 /* Receive window size (ZBUFFERED only)     */
+#endif
 
 /*
  * The ZRESULT type is the general return type for functions in this library.
@@ -180,6 +228,159 @@ typedef struct {
   uint8_t   PADDING;
 } ZHDR;
 
+// Fields present in ZFILEINFO
+#define ZFI_SIZE          0x01
+#define ZFI_MTIME         0x02
+#define ZFI_MODE          0x04
+#define ZFI_SERIAL        0x08
+#define ZFI_FILES_LEFT    0x10
+#define ZFI_BYTES_LEFT    0x20
+
+/*
+ * File information from ZFILE block 0 (see zm_parse_file_info). Everything
+ * after the name is optional - present says which fields the sender gave.
+ */
+typedef struct {
+  const char  *name;                          /* Points into the block          */
+  uint32_t    size;                           /* Bytes                          */
+  uint32_t    mtime;                          /* Seconds since 1970 (UTC)       */
+  uint32_t    mode;                           /* Unix mode bits                 */
+  uint32_t    serial;
+  uint32_t    files_left;                     /* Including this one             */
+  uint32_t    bytes_left;                     /* Including this one             */
+  uint8_t     present;                        /* ZFI_xxx                        */
+} ZFILEINFO;
+
+/*
+ * Transport hooks used by a session. The user pointer from the
+ * session is passed straight through, so one set of hooks can serve
+ * any number of links.
+ */
+#ifdef ZBUFFERED
+typedef ZRESULT (*ZRECVBUFFN)(void *user, uint8_t *buf, uint16_t *len);
+typedef ZRESULT (*ZSENDBUFFN)(void *user, const uint8_t *buf, uint16_t len);
+#else
+typedef ZRESULT (*ZRECVFN)(void *user);
+typedef ZRESULT (*ZSENDFN)(void *user, uint8_t chr);
+#endif
+
+/*
+ * Optional hook for the ATTNBRK / ATTNPSE escapes in the sender's Attn
+ * sequence - sig is one of those. They're skipped if there isn't one.
+ */
+typedef ZRESULT (*ZATTNFN)(void *user, uint8_t sig);
+
+/*
+ * Optional flow control hook, called before anything is sent. Return
+ * OK once it's clear to send - e.g. wait for CTS here - or an error
+ * to give up.
+ */
+typedef ZRESULT (*ZFLOWFN)(void *user);
+
+/*
+ * Optional hook to say whether there's anything to read right now,
+ * without waiting. With it, the sender notices ZRPOS between subpackets
+ * rather than only when it stops to wait (see zm_poll_header).
+ */
+typedef bool (*ZPEEKFN)(void *user);
+
+/*
+ * State for the push-style parser (see zfeed.h). Lives in the session,
+ * so a parse can be suspended at any byte and picked up on the next call.
+ */
+typedef struct {
+  uint8_t     state;
+  uint8_t     cans;                           /* CANs seen in current escape    */
+  uint8_t     count;                          /* Bytes collected so far         */
+  uint8_t     raw[HEX_HDR_STR_LEN];           /* Header / CRC bytes collected   */
+  uint8_t     frameend;                       /* ZCRCx that ended the data      */
+  uint32_t    crc;                            /* Running CRC of data subpacket  */
+  uint8_t     *data;                          /* Caller's subpacket buffer      */
+  uint16_t    data_max;
+  uint16_t    data_len;
+} ZFEED;
+
+/*
+ * Sending statistics, kept in the session (see zsender.h). Counts
+ * are since zm_sender_begin.
+ */
+typedef struct {
+  uint32_t    data_bytes;                     /* Data sent, including resends   */
+  uint32_t    subpackets;                     /* Data subpackets sent           */
+  uint16_t    rpos;                           /* ZRPOS after data (resends)     */
+  uint16_t    naks;                           /* ZNAK from the receiver         */
+  uint16_t    clean;                          /* Subpackets since last error    */
+  uint16_t    block_len;                      /* Subpacket size in use now      */
+  uint16_t    changes;                        /* Times block_len changed        */
+  uint16_t    history[ZSTATS_HISTORY];        /* Recent sizes (a ring)          */
+} ZSTATS;
+
+/*
+ * Retransmit ring for the windowed sender (see zsender.h). Holds the
+ * last len bytes of file data read before end_pos (or fewer, if fill
+ * says so), so going back after ZRPOS doesn't need the file again.
+ */
+typedef struct {
+  uint8_t     *buf;                           /* Caller's buffer (NULL = none)  */
+  uint32_t    len;
+  uint32_t    fill;                           /* Bytes in it                    */
+  uint32_t    end_pos;                        /* File position after the last   */
+} ZRING;
+
+/*
+ * Session context. Holds everything the library needs to keep between
+ * calls, so separate sessions (e.g. one per serial port) can run side
+ * by side, on separate threads if you like.
+ *
+ * Initialise with zm_init_ctx, then set the transport hooks (and user,
+ * if you need it) before passing it to any of the _ctx functions.
+ */
+typedef struct {
+#ifdef ZBUFFERED
+  ZRECVBUFFN  recv_buf;
+  ZSENDBUFFN  send_buf;
+#else
+  ZRECVFN     recv;
+  ZSENDFN     send;
+#endif
+  ZATTNFN     attn_sig;                       /* Break / pause (NULL = skip)    */
+  ZFLOWFN     flow;                           /* Wait to send (NULL = don't)    */
+  ZPEEKFN     peek;                           /* Input waiting (NULL = unknown) */
+  void        *user;                          /* Passed to transport hooks      */
+
+  uint8_t     in_32bit_block;                 /* Next data block is CRC32       */
+  uint8_t     rx_caps;                        /* Receiver's ZRINIT flags (send) */
+  uint16_t    rx_buf_len;                     /* Receiver's buffer (0 = stream) */
+  uint8_t     file_conv;                      /* ZFILE F0 to send (0 = ZCBIN)   */
+  uint8_t     peer_hdr;                       /* Best binary hdr peer sent (0)  */
+  uint16_t    block_max;                      /* Cap on block_len (0 = none)    */
+  uint16_t    block_limit;                    /* Most block_len can grow to     */
+  uint16_t    block_len;                      /* Subpacket size when sending    */
+  ZSTATS      stats;                          /* Sending statistics             */
+  uint32_t    window;                         /* Most unacked bytes (0 = any)   */
+  ZRING       ring;                           /* Sent subpackets, for ZRPOS     */
+  uint8_t     attn[ZATTNLEN];                 /* Sender's Attn from ZSINIT      */
+  uint16_t    timeouts;                       /* Timeouts since the last header */
+  uint16_t    timeout_budget;                 /* Most timeouts (0 = default)    */
+  uint16_t    garbage_max;                    /* Junk per header wait (0 = any) */
+  bool        xon_xoff;                       /* Pause sending on XOFF          */
+  bool        xoff;                           /* Got XOFF, waiting for XON      */
+  uint8_t     esc_last;                       /* Last byte out of the escaper   */
+  uint8_t     esc_table[256];                 /* See zescape.h                  */
+  ZHDR        hdr;                            /* Scratch for outgoing headers   */
+  ZHDR        retry_hdr;                      /* Last ZRINIT / ZRPOS sent       */
+  uint8_t     hex_buf[HEX_HDR_FRAME_LEN];     /* Scratch for hex-encoding       */
+  ZFEED       feed;                           /* Push-style parser state        */
+
+#ifdef ZBUFFERED
+  uint16_t    recv_pos;
+  uint16_t    recv_limit;
+  uint8_t     recv_win[ZRECV_WIN_LEN];
+#else
+  uint16_t    held;                           /* Byte put back (OK | byte)      */
+#endif
+} ZMCTX;
+
 #ifdef ZDEBUG
 #define DEBUGF(...)       printf(__VA_ARGS__)
 #else
@@ -13,11 +13,30 @@
  * ------------------------------------------------------------
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef __linux__
+#define _GNU_SOURCE               /* for fallocate */
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include "zmodem.h"
+#include "zcrc.h"
+#include "crc32.h"
 
 #ifdef ZEMBEDDED
 #define PRINTF(...)
@@ -27,62 +46,399 @@
 #define FPRINTF(...) fprintf(__VA_ARGS__)
 #endif
 
-// Spec says a data packet is max 1024 bytes, but add some headroom...
-#define DATA_BUF_LEN    2048
+// Spec says a data packet is max 1024 bytes, but we say CAN8K in ZRINIT
+// so senders that know about it can use 8K. Add some headroom...
+#define DATA_BUF_LEN    (ZBIG_BLOCK_LEN * 2)
+
+// Receive buffer size for ZRINIT. The writer thread keeps up with the
+// line here, so 0 (stream freely) - a receiver that has to stop to write
+// (e.g. to flash) would put its buffer size here.
+#define RX_BUF_LEN      0
+
+// Must be a power of two
+#define RING_LEN        0x4000
+#define RING_MASK       (RING_LEN - 1)
+
+#define OUT_BUF_LEN     0x100
+
+// Verified subpackets waiting for the writer thread. Must be a power of two
+#define QUEUE_LEN       64
+#define QUEUE_MASK      (QUEUE_LEN - 1)
+
+static int com = -1;
+
+// How long zm_recv waits before saying TIMEOUT. It waits forever (-1)
+// until we've sent ZRINIT, so there's something to send again.
+#define RECV_TIMEOUT_MS 2000
+static int recv_timeout = -1;
+
+// Most junk to skip looking for a header before complaining about it
+#define GARBAGE_MAX     0x1000
+
+// Received bytes; head is where the next byte comes from, tail where the next read goes
+static uint8_t ring[RING_LEN];
+static uint32_t ring_head, ring_tail;
+
+// Outgoing bytes are held here until we next need to wait for the other end
+static uint8_t out_buf[OUT_BUF_LEN];
+static uint16_t out_len;
+
+static bool flush_com() {
+  uint8_t *ptr = out_buf;
+
+  while (out_len) {
+    ssize_t count = write(com, ptr, out_len);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      DEBUGF("Write to com failed; errno is %d\n", errno);
+      out_len = 0;
+      return false;
+    }
+
+    ptr += count;
+    out_len -= count;
+  }
+
+  return true;
+}
+
+/*
+ * Read as much as is available (up to the end of the ring) in one go.
+ */
+static ZRESULT fill_ring() {
+  uint32_t start = ring_tail & RING_MASK;
+  uint32_t space = RING_LEN - start;
+  struct pollfd pfd = { .fd = com, .events = POLLIN };
+  ssize_t count;
+  int ready;
+
+  // Nothing more to say until the other end replies
+  if (!flush_com()) {
+    return CLOSED;
+  }
+
+  do {
+    ready = poll(&pfd, 1, recv_timeout);
+  } while (ready < 0 && errno == EINTR);
+
+  if (ready == 0) {
+    return TIMEOUT;
+  }
+
+  do {
+    count = read(com, ring + start, space);
+  } while (count < 0 && errno == EINTR);
+
+  if (count <= 0) {
+    return CLOSED;
+  }
 
-static FILE *com;
+  TRACEF(" !!!! fill_ring: read %ld byte(s)\n", (long)count);
+  ring_tail += count;
+  return OK;
+}
 
 /*
  * Implementation-defined receive character function.
  */
 ZRESULT zm_recv() {
-  uint8_t result;
+  ZRESULT err;
 
-  if (fread(&result, 1, 1, com) == 1) {
-    TRACEF(" !!!! zm_recv: read [0x%02x]\n", result);
-    return result;
-  } else {
-    DEBUGF("Read in zm_recv returned no data; Closed\n");
-    return CLOSED;
+  if (ring_head == ring_tail && (err = fill_ring()) != OK) {
+    DEBUGF("Read in zm_recv returned no data [0x%04x]\n", err);
+    return err;
   }
+
+  uint8_t result = ring[ring_head++ & RING_MASK];
+  TRACEF(" !!!! zm_recv: read [0x%02x]\n", result);
+  return result;
 }
 
 /*
  * Implementation-defined send character function.
  */
 ZRESULT zm_send(uint8_t chr) {
-  register int result = fputc((char)chr, com);
+  if (out_len == OUT_BUF_LEN && !flush_com()) {
+    return CLOSED;
+  }
 
-  if (result == EOF) {
+  out_buf[out_len++] = chr;
+  return OK;
+}
+
+/*
+ * Break / pause from the sender's Attn sequence (see zm_send_attn).
+ */
+static ZRESULT attn_sig(void *user, uint8_t sig) {
+  if (!flush_com()) {
     return CLOSED;
+  }
+
+  if (sig == ATTNBRK) {
+    tcsendbreak(com, 0);
   } else {
-    return OK;
+    sleep(1);
   }
+
+  return OK;
+}
+
+/*
+ * Single-producer / single-consumer queue between the protocol (main)
+ * thread and the writer thread, so a slow disk doesn't hold up the
+ * serial line. Subpackets are read straight into a slot, and only
+ * committed if they're good. Only the writer moves head, and only the
+ * protocol thread moves tail.
+ *
+ * The semaphores count filled and free slots, so whichever side has
+ * nothing to do sleeps until the other hands it something - the writer
+ * while the queue is empty, the protocol thread only when it's full.
+ */
+typedef struct {
+  FILE      *file;
+  uint16_t  len;
+  uint8_t   data[DATA_BUF_LEN];
+} SLOT;
+
+static SLOT queue[QUEUE_LEN];
+static atomic_uint queue_head, queue_tail;
+static atomic_bool writer_done, write_failed;
+static sem_t queue_filled, queue_free;
+static bool slot_claimed;           // Protocol thread holds a free slot
+static pthread_t writer;
+
+static void sem_wait_intr(sem_t *sem) {
+  while (sem_wait(sem) != 0 && errno == EINTR);
 }
 
-static FILE* init_com(int argc, char **argv) {
-    if (argc != 2) {
-        FPRINTF(stderr, "Usage: rz <device file>\n");
+static void* writer_main(void *arg) {
+  while (true) {
+    sem_wait_intr(&queue_filled);
+
+    unsigned head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+
+    // Only woken with nothing queued when we're done
+    if (head == atomic_load_explicit(&queue_tail, memory_order_acquire)) {
+      if (atomic_load(&writer_done)) {
         return NULL;
+      }
+
+      continue;
+    }
+
+    SLOT *slot = &queue[head & QUEUE_MASK];
+
+    if (slot->len && fwrite(slot->data, slot->len, 1, slot->file) != 1) {
+      atomic_store(&write_failed, true);
+    }
+
+    atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+    sem_post(&queue_free);
+  }
+}
+
+/*
+ * Set up the semaphores before the writer thread starts.
+ */
+static bool queue_init() {
+  if (sem_init(&queue_filled, 0, 0) != 0) {
+    return false;
+  }
+
+  if (sem_init(&queue_free, 0, QUEUE_LEN) != 0) {
+    sem_destroy(&queue_filled);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Next free slot - this is the only place the protocol thread waits
+ * for the writer. A slot that was read into but not committed (a bad
+ * subpacket) is handed out again.
+ */
+static SLOT* queue_slot() {
+  unsigned tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+
+  if (!slot_claimed) {
+    sem_wait_intr(&queue_free);
+    slot_claimed = true;
+  }
+
+  return &queue[tail & QUEUE_MASK];
+}
+
+/*
+ * Hand the slot from queue_slot over to the writer.
+ */
+static void queue_commit(FILE *file, uint16_t len) {
+  unsigned tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+  SLOT *slot = &queue[tail & QUEUE_MASK];
+
+  slot->file = file;
+  slot->len = len;
+  slot_claimed = false;
+
+  atomic_store_explicit(&queue_tail, tail + 1, memory_order_release);
+  sem_post(&queue_filled);
+}
+
+/*
+ * Wait for everything queued so far to be written, by taking every
+ * free slot (and then giving them back).
+ */
+static void queue_drain() {
+  unsigned count = QUEUE_LEN - slot_claimed;
+
+  for (unsigned i = 0; i < count; i++) {
+    sem_wait_intr(&queue_free);
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    sem_post(&queue_free);
+  }
+}
+
+/*
+ * Tell the writer to finish once the queue is empty, and wait for it.
+ */
+static void queue_finish() {
+  atomic_store(&writer_done, true);
+  sem_post(&queue_filled);
+  pthread_join(writer, NULL);
+}
+
+/*
+ * Decide whether to take a file, based on what the sender told us
+ * about it. Files bigger than max_size, or than the free space in
+ * the current directory, are skipped.
+ */
+static bool want_file(ZFILEINFO *info, unsigned long max_size) {
+  struct statvfs fs;
+
+  if (!(info->present & ZFI_SIZE)) {
+    DEBUGF("No size for '%s'; taking it anyway\n", info->name);
+    return true;
+  }
+
+  if (max_size && info->size > max_size) {
+    FPRINTF(stderr, "'%s' is too big (%lu byte(s), limit is %lu); Skipping...\n",
+            info->name, (unsigned long)info->size, max_size);
+    return false;
+  }
+
+  if (statvfs(".", &fs) == 0 && info->size > (unsigned long long)fs.f_bavail * fs.f_frsize) {
+    FPRINTF(stderr, "Not enough space for '%s' (%lu byte(s)); Skipping...\n",
+            info->name, (unsigned long)info->size);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Finish with an output file. It may have been preallocated, so cut
+ * it back to what we actually got.
+ */
+static bool close_output(FILE *out, uint32_t size) {
+  queue_drain();
+
+  if (fflush(out) != 0 || ftruncate(fileno(out), size) != 0) {
+    fclose(out);
+    return false;
+  }
+
+  return fclose(out) == 0;
+}
+
+/*
+ * Reserve space for the whole file up front, rather than growing it a
+ * block at a time. Where we can, the file size is left alone, so if
+ * we're killed part way the file only holds what we actually received
+ * (and can be resumed).
+ */
+static int preallocate(FILE *out, uint32_t size) {
+#ifdef FALLOC_FL_KEEP_SIZE
+  return fallocate(fileno(out), FALLOC_FL_KEEP_SIZE, 0, size) == 0 ? 0 : errno;
+#else
+  return posix_fallocate(fileno(out), 0, size);
+#endif
+}
+
+/*
+ * For ZCRESUM - work out how much of the file we already have, and ask
+ * the sender for the CRC of that much of its copy. Returns the length
+ * to carry on from, which is 0 unless the CRCs match.
+ */
+static uint32_t resume_point(ZFILEINFO *info) {
+  static uint8_t buf[0x10000];
+  uint32_t crc = CRC_START_32;
+  uint32_t len = 0;
+  size_t count;
+  struct stat st;
+  ZHDR hdr;
+  FILE *in = fopen(info->name, "rb");
+
+  if (in == NULL) {
+    return 0;
+  }
+
+  // ZMODEM positions are 32 bits, so there's no carrying on past 4GiB
+  if (fstat(fileno(in), &st) != 0 || st.st_size > (off_t)UINT32_MAX) {
+    FPRINTF(stderr, "WARN: Can't resume '%s' (too big, or can't tell); Starting from scratch\n", info->name);
+    fclose(in);
+    return 0;
+  }
+
+  while ((count = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (info->present & ZFI_SIZE && len + count > info->size) {
+      count = info->size - len;
+    }
+
+    crc = zm_crc32_update(crc, buf, count);
+    len += count;
+  }
+
+  fclose(in);
+  crc = ~crc;
+
+  if (len == 0) {
+    return 0;
+  }
+
+  DEBUGF("Have 0x%08x byte(s) of '%s' already (CRC 0x%08x); Checking...\n", len, info->name, crc);
+
+  if (zm_send_pos_hdr(ZCRC, len) != OK || zm_await_header(&hdr) != OK || hdr.type != ZCRC) {
+    FPRINTF(stderr, "WARN: Sender didn't answer ZCRC; Starting from scratch\n");
+    return 0;
+  }
+
+  if (BTODW(hdr.position.p0, hdr.position.p1, hdr.position.p2, hdr.position.p3) != crc) {
+    FPRINTF(stderr, "WARN: Existing '%s' doesn't match; Starting from scratch\n", info->name);
+    return 0;
+  }
+
+  return len;
+}
+
+static int init_com(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        FPRINTF(stderr, "Usage: rz <device file> [max file size]\n");
+        return -1;
     } else {
         char *fn = argv[1];
 
         FPRINTF(stderr, "Opening '%s' as com device\n", fn);
-        FILE *com = fopen(fn, "wb+");
+        int com = open(fn, O_RDWR | O_NOCTTY);
 
-        if (com == NULL) {
+        if (com < 0) {
             FPRINTF(stderr, "Failed to open; quitting\n");
-            return NULL;
-        }
-
-        if (setvbuf(com, NULL, _IONBF, 0) != 0) {
-            FPRINTF(stderr, "Failed to disable buffering; Bailing...\n");
-
-            if (fclose(com) != 0) {
-                FPRINTF(stderr, "WARN: File not closed successfully!'n");
-            }
-
-            return NULL;
+            return -1;
         }
 
         return com;
@@ -92,8 +448,14 @@ static FILE* init_com(int argc, char **argv) {
 int main(int argc, char **argv) {
   uint8_t rzr_buf[4];
   uint8_t data_buf[DATA_BUF_LEN];
+  uint8_t *block_buf;
   uint16_t count;
   uint32_t received_data_size = 0;
+  uint32_t file_pos = 0;
+  bool resume;
+  bool resync = false;
+  unsigned long max_size = argc == 3 ? strtoul(argv[2], NULL, 0) : 0;
+  ZFILEINFO info;
   ZHDR hdr;
   FILE *out = NULL;
 
@@ -101,8 +463,16 @@ int main(int argc, char **argv) {
   uint32_t bad_block_count = 0;
 #endif
 
-  if ((com = init_com(argc, argv)) != NULL) {
+  if ((com = init_com(argc, argv)) >= 0) {
     DEBUGF("Opened port just fine\n");
+    zm_default_ctx()->attn_sig = attn_sig;
+    zm_default_ctx()->garbage_max = GARBAGE_MAX;
+
+    if (!queue_init() || pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+      FPRINTF(stderr, "Failed to start writer thread; Bailing...\n");
+      close(com);
+      return 2;
+    }
 
     PRINTF("rosco_m68k ZMODEM receive example v0.01 - Awaiting remote transfer initiation...\n");
 
@@ -112,21 +482,50 @@ int main(int argc, char **argv) {
       while (true) {
 startframe:
         DEBUGF("\n====================================\n");
-        uint16_t result = zm_await_header(&hdr);
+        // After an error, zm_resync sends ZRPOS and skips the rest of the
+        // sender's frame until it's back where we want it
+        uint16_t result = resync ? zm_resync(file_pos, &hdr) : zm_await_header(&hdr);
+        resync = false;
 
         switch (result) {
         case CANCELLED:
           FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
           goto cleanup;
+        case CLOSED:
+          FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+          goto cleanup;
+        case TIMEOUT:
+          // Sends the last ZRINIT / ZRPOS / ZACK again now and then
+          result = zm_timeout();
+
+          if (result == TIMEOUT) {
+            FPRINTF(stderr, "Remote stopped responding; Bailing...\n");
+            goto cleanup;
+          } else if (result == CLOSED) {
+            FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+            goto cleanup;
+          }
+
+          continue;
         case OK:
           DEBUGF("Got valid header\n");
 
           switch (hdr.type) {
-          case ZRQINIT:
           case ZEOF:
+            // If it's not where we are, we've sent ZRPOS and the sender
+            // just hasn't seen it yet - it'll be back.
+            if (out != NULL && BTODW(hdr.position.p0, hdr.position.p1,
+                                     hdr.position.p2, hdr.position.p3) != file_pos) {
+              DEBUGF("Ignoring ZEOF at wrong place [Pos: 0x%08x]\n", file_pos);
+              continue;
+            }
+
+            // fall through
+          case ZRQINIT:
             DEBUGF("Is ZRQINIT or ZEOF\n");
 
-            result = zm_send_flags_hdr(ZRINIT, CANOVIO | CANFC32, 0, 0, 0);
+            result = zm_send_zrinit(CANOVIO | CANFC32, CAN8K, RX_BUF_LEN);
+            recv_timeout = RECV_TIMEOUT_MS;
 
             if (result == CANCELLED) {
               FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -140,6 +539,25 @@ startframe:
 
             continue;
 
+          case ZSINIT:
+            DEBUGF("Is ZSINIT\n");
+
+            // Keeps the Attn sequence for zm_resync, and ACKs
+            result = zm_read_zsinit(&hdr);
+
+            if (result == CANCELLED) {
+              FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
+              goto cleanup;
+            } else if (result == CLOSED) {
+              FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+              goto cleanup;
+            } else if (IS_ERROR(result) && zm_send_pos_hdr(ZNAK, 0) == CLOSED) {
+              FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+              goto cleanup;
+            }
+
+            continue;
+
           case ZFIN:
             DEBUGF("Is ZFIN\n");
 
@@ -160,6 +578,8 @@ startframe:
           case ZFILE:
             DEBUGF("Is ZFILE\n");
 
+            resume = hdr.flags.f0 == ZCRESUM;
+
             switch (hdr.flags.f0) {
             case 0:     /* no special treatment - default to ZCBIN */
             case ZCBIN:
@@ -169,7 +589,7 @@ startframe:
               DEBUGF("--> ASCII Receive; Fix newlines (IGNORED - NOT SUPPORTED)\n");
               break;
             case ZCRESUM:
-              DEBUGF("--> Resume interrupted transfer (IGNORED - NOT SUPPORTED)\n");
+              DEBUGF("--> Resume interrupted transfer\n");
               break;
             default:
               FPRINTF(stderr, "WARN: Invalid conversion flag [0x%02x] (IGNORED - Assuming Binary)\n", hdr.flags.f0);
@@ -183,15 +603,78 @@ startframe:
               FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
               goto cleanup;
             } else if (!IS_ERROR(result)) {
-              PRINTF("Receiving file: '%s'\n", data_buf);
+              if (out != NULL) {
+                if (!close_output(out, file_pos)) {
+                  FPRINTF(stderr, "Failed to close output file\n");
+                }
+
+                out = NULL;
+              }
+
+              if (zm_parse_file_info(data_buf, count, &info) != OK) {
+                FPRINTF(stderr, "Bad file information from remote; Bailing...\n");
+                goto cleanup;
+              }
+
+              if (!want_file(&info, max_size)) {
+                result = zm_send_pos_hdr(ZSKIP, 0);
+
+                if (result == CANCELLED) {
+                  FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
+                  goto cleanup;
+                } else if(result == CLOSED) {
+                  FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+                  goto cleanup;
+                }
+
+                continue;
+              }
+
+              file_pos = resume ? resume_point(&info) : 0;
+
+              if (file_pos) {
+                PRINTF("Resuming file: '%s' from %u byte(s)\n", info.name, file_pos);
+
+                if ((out = fopen(info.name, "r+b")) != NULL && fseek(out, file_pos, SEEK_SET) != 0) {
+                  fclose(out);
+                  out = NULL;
+                }
+              } else {
+                PRINTF("Receiving file: '%s'\n", info.name);
+                out = fopen(info.name, "wb");
+              }
 
-              out = fopen((char*)data_buf, "wb");
               if (out == NULL) {
                 FPRINTF(stderr, "Error opening file for output; Bailing...\n");
                 goto cleanup;
               }
 
-              result = zm_send_pos_hdr(ZRPOS, received_data_size);
+              if (info.present & ZFI_SIZE && info.size > 0) {
+                int err = preallocate(out, info.size);
+
+                if (err == ENOSPC) {
+                  FPRINTF(stderr, "Not enough space for '%s'; Skipping...\n", info.name);
+                  fclose(out);
+                  out = NULL;
+                  remove(info.name);
+
+                  result = zm_send_pos_hdr(ZSKIP, 0);
+
+                  if (result == CANCELLED) {
+                    FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
+                    goto cleanup;
+                  } else if(result == CLOSED) {
+                    FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+                    goto cleanup;
+                  }
+
+                  continue;
+                } else if (err != 0) {
+                  DEBUGF("Preallocation failed (%d); carrying on without\n", err);
+                }
+              }
+
+              result = zm_send_pos_hdr(ZRPOS, file_pos);
 
               if (result == CANCELLED) {
                 FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -211,9 +694,18 @@ startframe:
           case ZDATA:
             DEBUGF("Is ZDATA\n");
 
+            // Left over from an earlier ZRPOS - ask again for where we are
+            if (out != NULL && BTODW(hdr.position.p0, hdr.position.p1,
+                                     hdr.position.p2, hdr.position.p3) != file_pos) {
+              DEBUGF("ZDATA at wrong place [Pos: 0x%08x]\n", file_pos);
+              resync = true;
+              continue;
+            }
+
             while (true) {
+              block_buf = queue_slot()->data;
               count = DATA_BUF_LEN;
-              result = zm_read_data_block(data_buf, &count);
+              result = zm_read_data_block(block_buf, &count);
               DEBUGF("Result of data block read is [0x%04x] (got %d character(s))\n", result, count);
 
               if (out == NULL) {
@@ -227,22 +719,28 @@ startframe:
               } else if (!IS_ERROR(result)) {
                 DEBUGF("Received %d byte(s) of data\n", count);
 
-                fwrite(data_buf, count - 1, 1, out);
+                queue_commit(out, count - 1);
                 received_data_size += (count - 1);
+                file_pos += (count - 1);
+
+                if (atomic_load(&write_failed)) {
+                  FPRINTF(stderr, "Error writing output file; Bailing...\n");
+                  goto cleanup;
+                }
 
                 if (result == GOT_CRCE) {
                   // End of frame, header follows, no ZACK expected.
-                  DEBUGF("Got CRCE; Frame done [NOACK] [Pos: 0x%08x]\n", received_data_size);
+                  DEBUGF("Got CRCE; Frame done [NOACK] [Pos: 0x%08x]\n", file_pos);
                   break;
                 } else if (result == GOT_CRCG) {
                   // Frame continues, non-stop (another data packet follows)
-                  DEBUGF("Got CRCG; Frame continues [NOACK] [Pos: 0x%08x]\n", received_data_size);
+                  DEBUGF("Got CRCG; Frame continues [NOACK] [Pos: 0x%08x]\n", file_pos);
                   continue;
                 } else if (result == GOT_CRCQ) {
                   // Frame continues, ZACK required
-                  DEBUGF("Got CRCQ; Frame continues [ACK] [Pos: 0x%08x]\n", received_data_size);
+                  DEBUGF("Got CRCQ; Frame continues [ACK] [Pos: 0x%08x]\n", file_pos);
 
-                  result = zm_send_pos_hdr(ZACK, received_data_size);
+                  result = zm_send_pos_hdr(ZACK, file_pos);
 
                   if (result == CANCELLED) {
                     FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -257,9 +755,9 @@ startframe:
                   continue;
                 } else if (result == GOT_CRCW) {
                   // End of frame, header follows, ZACK expected.
-                  DEBUGF("Got CRCW; Frame done [ACK] [Pos: 0x%08x]\n", received_data_size);
+                  DEBUGF("Got CRCW; Frame done [ACK] [Pos: 0x%08x]\n", file_pos);
 
-                  result = zm_send_pos_hdr(ZACK, received_data_size);
+                  result = zm_send_pos_hdr(ZACK, file_pos);
 
                   if (result == CANCELLED) {
                     FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -277,27 +775,17 @@ startframe:
               } else {
                 DEBUGF("Error while receiving block: 0x%04x\n", result);
 
-                result = zm_send_pos_hdr(ZRPOS, received_data_size);
-
 #ifdef ZDEBUG_DUMP_BAD_BLOCKS
                 char name[20];
                 snprintf(name, 20, "block%d.bin", bad_block_count++);
                 DEBUGF("  >> Writing file '%s'\n", name);
                 FILE *block = fopen(name, "wb");
-                fwrite(data_buf,count,1,block);
+                fwrite(block_buf,count,1,block);
                 fclose(block);
 #endif
 
-                if (result == CANCELLED) {
-                  FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
-                  goto cleanup;
-                } else if (result == OK) {
-                  DEBUGF("Send ZRPOS was OK\n");
-                  goto startframe;
-                } else if(result == CLOSED) {
-                  FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
-                  goto cleanup;
-                }
+                resync = true;
+                goto startframe;
               }
             }
 
@@ -312,7 +800,7 @@ startframe:
         case BAD_CRC:
           DEBUGF("Didn't get valid header - CRC Check failed\n");
 
-          result = zm_send_pos_hdr(ZNAK, received_data_size);
+          result = zm_send_pos_hdr(ZNAK, file_pos);
 
           if (result == CANCELLED) {
             FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -325,10 +813,14 @@ startframe:
           }
 
           continue;
+        case TOO_MUCH_GARBAGE:
+          FPRINTF(stderr, "WARN: Lots of noise on the line (not ZMODEM?)\n");
+
+          // fall through
         default:
           DEBUGF("Didn't get valid header - result is 0x%04x\n", result);
 
-          result = zm_send_pos_hdr(ZNAK, received_data_size);
+          result = zm_send_pos_hdr(ZNAK, file_pos);
 
           if (result == CANCELLED) {
             FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
@@ -346,11 +838,13 @@ startframe:
     }
 
     cleanup:
-    
-    if (out != NULL && fclose(out)) {
+
+    queue_finish();
+
+    if (out != NULL && !close_output(out, file_pos)) {
       FPRINTF(stderr, "Failed to close output file\n");
     }
-    if (com != NULL && fclose(com)) {
+    if (!flush_com() || close(com)) {
       FPRINTF(stderr, "Failed to close serial port\n");
     }
 
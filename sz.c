@@ -0,0 +1,322 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _   
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_ 
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_| 
+ *                     |_____|       firmware v1                 
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Example usage of Zmodem sender
+ * ------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include "zmodem.h"
+
+#ifdef ZEMBEDDED
+#define PRINTF(...)
+#define FPRINTF(...)
+#else
+#define PRINTF(...) printf(__VA_ARGS__)
+#define FPRINTF(...) fprintf(__VA_ARGS__)
+#endif
+
+// Most data in flight before waiting for the receiver to catch up, and
+// a ring big enough to resend all of it (if we can't map the file)
+#define WINDOW_LEN      0x10000
+
+// Give up waiting for XON after this long
+#define XOFF_TIMEOUT_MS 10000
+
+// Bytes picked up by flow() while looking for XOFF, for zm_recv. Must
+// be a power of two
+#define STASH_LEN       64
+#define STASH_MASK      (STASH_LEN - 1)
+
+#define OUT_BUF_LEN     0x1000
+
+static FILE *com;
+static uint8_t ring[WINDOW_LEN];
+static uint8_t stash[STASH_LEN];
+static unsigned stash_head, stash_tail;
+
+// Outgoing bytes are held here until we next look for the other end
+static uint8_t out_buf[OUT_BUF_LEN];
+static uint16_t out_len;
+
+static bool flush_com() {
+  uint8_t *ptr = out_buf;
+
+  while (out_len) {
+    ssize_t count = write(fileno(com), ptr, out_len);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      DEBUGF("Write to com failed; errno is %d\n", errno);
+      out_len = 0;
+      return false;
+    }
+
+    ptr += count;
+    out_len -= count;
+  }
+
+  return true;
+}
+
+/*
+ * Implementation-defined receive character function.
+ */
+ZRESULT zm_recv() {
+  uint8_t result;
+
+  // Nothing more to say until the other end replies
+  if (!flush_com()) {
+    return CLOSED;
+  } else if (stash_head != stash_tail) {
+    return stash[stash_head++ & STASH_MASK];
+  } else if (fread(&result, 1, 1, com) == 1) {
+    TRACEF(" !!!! zm_recv: read [0x%02x]\n", result);
+    return result;
+  } else {
+    DEBUGF("Read in zm_recv returned no data; Closed\n");
+    return CLOSED;
+  }
+}
+
+/*
+ * Implementation-defined send character function.
+ */
+ZRESULT zm_send(uint8_t chr) {
+  if (out_len == OUT_BUF_LEN && !flush_com()) {
+    return CLOSED;
+  }
+
+  out_buf[out_len++] = chr;
+  return OK;
+}
+
+/*
+ * Flow hook. The library only reads when it's waiting for a header, so
+ * look for an XOFF that's come in while we're streaming, and hold off
+ * until XON if there is one. Anything else is kept for zm_recv. What
+ * went out before (which was clear to send) is written first.
+ */
+static ZRESULT flow(void *user) {
+  struct pollfd pfd = { .fd = fileno(com), .events = POLLIN };
+  bool paused = false;
+  uint8_t c;
+
+  if (!flush_com()) {
+    return CLOSED;
+  }
+
+  while (poll(&pfd, 1, paused ? XOFF_TIMEOUT_MS : 0) > 0) {
+    if (fread(&c, 1, 1, com) != 1) {
+      return CLOSED;
+    }
+
+    if ((c & 0x7f) == XOFF) {
+      DEBUGF("Got XOFF; Pausing\n");
+      paused = true;
+    } else if ((c & 0x7f) == XON) {
+      paused = false;
+    } else if (stash_tail - stash_head < STASH_LEN) {
+      stash[stash_tail++ & STASH_MASK] = c;
+    } else {
+      // Only the receiver's headers come this way, and it won't send
+      // that many without hearing from us
+      DEBUGF("Stash full; Dropped [0x%02x]\n", c);
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * Peek hook, so the sender sees ZRPOS while it's streaming. Whatever
+ * flow has already picked up counts.
+ */
+static bool peek(void *user) {
+  struct pollfd pfd = { .fd = fileno(com), .events = POLLIN };
+
+  // Let the last subpacket go while we're at it
+  flush_com();
+
+  return stash_head != stash_tail || poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * File data source for the sender.
+ */
+static ZRESULT read_file(void *source, uint32_t offset, uint8_t *buf, uint16_t *len) {
+  FILE *in = (FILE*)source;
+
+  if (fseek(in, offset, SEEK_SET) != 0) {
+    DEBUGF("Seek to 0x%08x failed\n", offset);
+    return CLOSED;
+  }
+
+  *len = fread(buf, 1, *len, in);
+
+  if (ferror(in)) {
+    DEBUGF("Read at 0x%08x failed\n", offset);
+    return CLOSED;
+  }
+
+  return OK;
+}
+
+static FILE* init_com(char *fn) {
+    FPRINTF(stderr, "Opening '%s' as com device\n", fn);
+    FILE *com = fopen(fn, "wb+");
+
+    if (com == NULL) {
+        FPRINTF(stderr, "Failed to open; quitting\n");
+        return NULL;
+    }
+
+    if (setvbuf(com, NULL, _IONBF, 0) != 0) {
+        FPRINTF(stderr, "Failed to disable buffering; Bailing...\n");
+
+        if (fclose(com) != 0) {
+            FPRINTF(stderr, "WARN: File not closed successfully!'n");
+        }
+
+        return NULL;
+    }
+
+    return com;
+}
+
+int main(int argc, char **argv) {
+  FILE *in = NULL;
+  uint8_t *map = MAP_FAILED;
+  char *name;
+  long size;
+  ZRESULT result;
+  int status = 1;
+
+  // -r asks the receiver to resume from whatever it already has
+  if (argc == 4 && strcmp(argv[1], "-r") == 0) {
+    zm_default_ctx()->file_conv = ZCRESUM;
+    argc--;
+    argv++;
+  }
+
+  if (argc != 3) {
+    FPRINTF(stderr, "Usage: sz [-r] <device file> <file>\n");
+    return 2;
+  }
+
+  if ((in = fopen(argv[2], "rb")) == NULL) {
+    FPRINTF(stderr, "Unable to open '%s'\n", argv[2]);
+    return 2;
+  }
+
+  if (fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0) {
+    FPRINTF(stderr, "Unable to get size of '%s'\n", argv[2]);
+    fclose(in);
+    return 2;
+  }
+
+  // ZMODEM file positions are 32 bits, so that's as big as it gets
+  if ((unsigned long)size > UINT32_MAX) {
+    FPRINTF(stderr, "'%s' is too big to send (%ld byte(s), limit is %lu)\n",
+            argv[2], size, (unsigned long)UINT32_MAX);
+    fclose(in);
+    return 2;
+  }
+
+  // Receiver only wants the name, not where it lives here
+  name = strrchr(argv[2], '/');
+  name = name ? name + 1 : argv[2];
+
+  if ((com = init_com(argv[1])) != NULL) {
+    DEBUGF("Opened port just fine\n");
+
+    PRINTF("rosco_m68k ZMODEM send example v0.01 - Sending '%s' (%ld byte(s))\n", name, size);
+
+    zm_sender_window(WINDOW_LEN, ring, sizeof(ring));
+    zm_default_ctx()->xon_xoff = true;
+    zm_default_ctx()->flow = flow;
+    zm_default_ctx()->peek = peek;
+
+    if ((result = zm_sender_begin()) != OK) {
+      FPRINTF(stderr, "Receiver didn't start [0x%04x]; Bailing...\n", result);
+      goto cleanup;
+    }
+
+    // Send straight from the page cache if we can; fall back to reading it
+    if (size > 0) {
+      map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    }
+
+    if (map != MAP_FAILED) {
+      DEBUGF("Sending from mapping at %p\n", (void*)map);
+      result = zm_send_mem(name, map, size);
+    } else {
+      result = zm_send_file(name, size, read_file, in);
+    }
+
+    if (result == SKIPPED) {
+      PRINTF("Receiver skipped '%s'\n", name);
+    } else if (result == CANCELLED) {
+      FPRINTF(stderr, "Transfer cancelled by remote; Bailing...\n");
+      goto cleanup;
+    } else if (result == CLOSED) {
+      FPRINTF(stderr, "Connection closed prematurely; Bailing...\n");
+      goto cleanup;
+    } else if (result != OK) {
+      FPRINTF(stderr, "Transfer failed [0x%04x]; Bailing...\n", result);
+      goto cleanup;
+    }
+
+    ZRESULT end_result = zm_sender_end();
+
+    if (end_result != OK) {
+      FPRINTF(stderr, "WARN: Session didn't end cleanly [0x%04x]\n", end_result);
+    }
+
+    if (result == OK) {
+      ZSTATS *stats = &zm_default_ctx()->stats;
+
+      PRINTF("Transfer complete; Sent %ld byte(s)\n", size);
+      PRINTF("%lu byte(s) in %lu subpacket(s); %u resend(s); Finished on %u-byte subpackets\n",
+             (unsigned long)stats->data_bytes, (unsigned long)stats->subpackets,
+             stats->rpos, stats->block_len);
+    }
+    status = 0;
+
+    cleanup:
+
+    if (!flush_com() || fclose(com)) {
+      FPRINTF(stderr, "Failed to close serial port\n");
+    }
+  } else {
+    PRINTF("Unable to open port\n");
+    status = 2;
+  }
+
+  if (map != MAP_FAILED) {
+    munmap(map, size);
+  }
+
+  fclose(in);
+  return status;
+}
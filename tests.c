@@ -16,18 +16,33 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include "zmodem.h"
 #include "acutest.h"
+#include "crc16.h"
+#include "crc32.h"
+#include "zcrc.h"
+#include "zscan.h"
+#include "zsender.h"
+#include "zescape.h"
 
 #define RECV_LEN 1024
+#define SENT_LEN 8192
 
 static char recv_buf[RECV_LEN];
 static char *buf_ptr, *buf_limit;
+static char *buf_end;                       /* Rest arrives when recv waits    */
+static ZRESULT recv_end = CLOSED;          /* What recv gives once buf runs out */
+
+static uint8_t sent_buf[SENT_LEN];
+static int sent_len;
 
 /* Set up the fake receive buffer for use in tests */
 uint16_t set_buf(char* buf, int len) {
   buf_ptr = buf_limit = recv_buf;
+  sent_len = 0;
+  zm_purge();
 
   if (len > RECV_LEN) {
     return UNSUPPORTED;
@@ -36,23 +51,117 @@ uint16_t set_buf(char* buf, int len) {
       *buf_limit++ = buf[i];
     }
 
+    buf_end = buf_limit;
     return OK;
   }
 }
 
 /* recv implementation for use in tests */
 ZRESULT zm_recv() {
+  if (buf_ptr == buf_limit) {
+    buf_limit = buf_end;
+  }
+
   if (buf_ptr < buf_limit) {
-    return *buf_ptr++;
+    return (uint8_t)*buf_ptr++;
   } else {
-    return CLOSED;
+    return recv_end;
   }
 }
 
 /* send implementation for use in tests */
 ZRESULT zm_send(uint8_t c) {
+  if (sent_len < SENT_LEN) {
+    sent_buf[sent_len++] = c;
+  }
+
+  return OK;
+}
+
+#ifdef ZBUFFERED
+/*
+ * Block recv implementation for use in tests. Hands out a few bytes at
+ * a time so the library has to refill its window mid-header / mid-block.
+ */
+#define RECV_CHUNK 7
+
+ZRESULT zm_recv_buf(uint8_t *buf, uint16_t *len) {
+  uint16_t max = *len < RECV_CHUNK ? *len : RECV_CHUNK;
+  *len = 0;
+
+  if (buf_ptr == buf_limit) {
+    buf_limit = buf_end;
+  }
+
+  while (*len < max && buf_ptr < buf_limit) {
+    buf[(*len)++] = *buf_ptr++;
+  }
+
+  return *len ? OK : recv_end;
+}
+
+/* Block send implementation for use in tests */
+ZRESULT zm_send_buf(const uint8_t *buf, uint16_t len) {
+  while (len--) {
+    zm_send(*buf++);
+  }
+
+  return OK;
+}
+#endif
+
+/* Fake link for tests that use their own session contexts */
+typedef struct {
+  const char *ptr;
+  const char *limit;
+} TESTLINK;
+
+#ifdef ZBUFFERED
+static ZRESULT link_recv_buf(void *user, uint8_t *buf, uint16_t *len) {
+  TESTLINK *link = (TESTLINK*)user;
+  uint16_t max = *len;
+  *len = 0;
+
+  while (*len < max && link->ptr < link->limit) {
+    buf[(*len)++] = *link->ptr++;
+  }
+
+  return *len ? OK : recv_end;
+}
+
+static ZRESULT link_send_buf(void *user, const uint8_t *buf, uint16_t len) {
+  return OK;
+}
+#else
+static ZRESULT link_recv(void *user) {
+  TESTLINK *link = (TESTLINK*)user;
+
+  if (link->ptr < link->limit) {
+    return (uint8_t)*link->ptr++;
+  } else {
+    return CLOSED;
+  }
+}
+
+static ZRESULT link_send(void *user, uint8_t c) {
   return OK;
 }
+#endif
+
+static void init_link_ctx(ZMCTX *ctx, TESTLINK *link, const char *data, int len) {
+  link->ptr = data;
+  link->limit = data + len;
+
+  zm_init_ctx(ctx);
+#ifdef ZBUFFERED
+  ctx->recv_buf = link_recv_buf;
+  ctx->send_buf = link_send_buf;
+#else
+  ctx->recv = link_recv;
+  ctx->send = link_send;
+#endif
+  ctx->user = link;
+}
 
 /* Tests of the tests */
 void test_recv_buffer() {
@@ -394,6 +503,1329 @@ void test_read_escaped() {
   TEST_CHECK(zm_read_escaped() == 'Z');
 }
 
+void test_read_data_block() {
+  uint8_t buf[16];
+  uint16_t len;
+
+  // "AB", ZDLE-escaped XON, "C", ZDLE-escaped ZDLE, ZCRCE - CRC16 is 0x34c1
+  set_buf("AB\x18\x51" "C\x18\x58\x18h\x34\xc1", 11);
+
+  len = 16;
+  TEST_CHECK(zm_read_data_block(buf, &len) == GOT_CRCE);
+  TEST_CHECK(len == 6);
+  TEST_CHECK(memcmp(buf, "AB\x11" "C\x18h", 6) == 0);
+
+  // Same block with corrupted CRC
+  set_buf("AB\x18\x51" "C\x18\x58\x18h\x34\xc2", 11);
+
+  len = 16;
+  TEST_CHECK(zm_read_data_block(buf, &len) == BAD_CRC);
+
+  // Unescaped XON/XOFF in the data are dropped - CRC16 is 0x1b44
+  set_buf("A\x11" "B\x13" "C\x18\x58\x18h\x1b\x44", 11);
+
+  len = 16;
+  TEST_CHECK(zm_read_data_block(buf, &len) == GOT_CRCE);
+  TEST_CHECK(len == 5);
+  TEST_CHECK(memcmp(buf, "ABC\x18h", 5) == 0);
+
+  // Too long for the supplied buffer
+  set_buf("ABCDEFGH\x18h\x00\x00", 12);
+
+  len = 4;
+  TEST_CHECK(zm_read_data_block(buf, &len) == OUT_OF_SPACE);
+  TEST_CHECK(len == 4);
+}
+
+void test_send_hex_hdr() {
+  set_buf("", 0);
+
+  TEST_CHECK(zm_send_flags_hdr(ZRINIT, CANOVIO | CANFC32, 0, 0, 0) == OK);
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+  TEST_CHECK(memcmp("**\x18" "B0100000022ae71\r\x8a\x11", sent_buf, HEX_HDR_FRAME_LEN) == 0);
+
+  set_buf("", 0);
+
+  TEST_CHECK(zm_send_pos_hdr(ZRPOS, 0x12345678) == OK);
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+  TEST_CHECK(memcmp("**\x18" "B0978563412", sent_buf, 14) == 0);
+}
+
+void test_send_bin_hdr() {
+  ZMCTX *ctx = zm_default_ctx();
+  char wire[32];
+  int wire_len;
+  ZHDR hdr;
+
+  // Hex until the other end has sent a binary header
+  ctx->peer_hdr = 0;
+  set_buf("", 0);
+
+  TEST_CHECK(zm_send_pos_hdr(ZACK, 0x11223344) == OK);
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+
+  set_buf("*\x18" "C\x0a\x00\x00\x00\x00\xbc\xef\x92\x8c", 12);
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+  TEST_CHECK(ctx->peer_hdr == ZBIN32);
+
+  // Now ZBIN32, with the 0x11 (XON) escaped
+  set_buf("", 0);
+
+  TEST_CHECK(zm_send_pos_hdr(ZACK, 0x11223344) == OK);
+  TEST_CHECK(sent_len < HEX_HDR_FRAME_LEN);
+  TEST_CHECK(memcmp(sent_buf, "*\x18" "C\x03\x44\x33\x22\x18\x51", 9) == 0);
+
+  // ... and it reads back
+  memcpy(wire, sent_buf, sent_len);
+  wire_len = sent_len;
+  set_buf(wire, wire_len);
+
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+  TEST_CHECK(hdr.type == ZACK);
+  TEST_CHECK(BTODW(hdr.position.p0, hdr.position.p1, hdr.position.p2, hdr.position.p3) == 0x11223344);
+
+  // ZBIN16 reads back too, and doesn't make us drop back from ZBIN32
+  set_buf("", 0);
+  hdr.type = ZRPOS;
+  hdr.position.p0 = 0x18;
+  hdr.position.p1 = hdr.position.p2 = hdr.position.p3 = 0;
+
+  TEST_CHECK(zm_send_bin16_hdr(&hdr) == OK);
+  TEST_CHECK(memcmp(sent_buf, "*\x18" "A\x09\x18\x58\x00\x00\x00", 9) == 0);
+
+  memcpy(wire, sent_buf, sent_len);
+  wire_len = sent_len;
+  set_buf(wire, wire_len);
+
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+  TEST_CHECK(hdr.type == ZRPOS && hdr.position.p0 == 0x18);
+  TEST_CHECK(ctx->peer_hdr == ZBIN32);
+
+  ctx->peer_hdr = 0;
+}
+
+void test_ctx_sessions() {
+  ZMCTX ctx_a, ctx_b;
+  TESTLINK link_a, link_b;
+  ZHDR hdr_a, hdr_b;
+  uint8_t buf[16];
+  uint16_t len;
+
+  // Session A gets a hex header (CRC16 data follows), session B a
+  // BIN32 ZDATA header (CRC32 data follows).
+  init_link_ctx(&ctx_a, &link_a, "01020304058208" "ABC\x18h\xde\xd4", 21);
+  init_link_ctx(&ctx_b, &link_b, "\x0a\x00\x00\x00\x00\xbc\xef\x92\x8c" "XYZ\x18h\xda\xb1\xad\x4f", 18);
+
+  TEST_CHECK(zm_read_hex_header_ctx(&ctx_a, &hdr_a) == OK);
+  TEST_CHECK(zm_read_binary32_header_ctx(&ctx_b, &hdr_b) == OK);
+  TEST_CHECK(hdr_a.type == 0x01);
+  TEST_CHECK(hdr_b.type == ZDATA);
+
+  // Interleave the blocks - each session must remember its own CRC mode
+  len = 16;
+  TEST_CHECK(zm_read_data_block_ctx(&ctx_b, buf, &len) == GOT_CRCE);
+  TEST_CHECK(len == 4);
+  TEST_CHECK(memcmp(buf, "XYZh", 4) == 0);
+
+  len = 16;
+  TEST_CHECK(zm_read_data_block_ctx(&ctx_a, buf, &len) == GOT_CRCE);
+  TEST_CHECK(len == 4);
+  TEST_CHECK(memcmp(buf, "ABCh", 4) == 0);
+
+  TEST_CHECK(zm_read_escaped_ctx(&ctx_a) == CLOSED);
+  TEST_CHECK(zm_read_escaped_ctx(&ctx_b) == CLOSED);
+}
+
+void test_crc_update() {
+  uint8_t buf[256];
+  uint16_t crc16_ref;
+  uint32_t crc32_ref;
+
+  // Standard check values
+  TEST_CHECK(crc16_update(CRC_START_XMODEM, (uint8_t*)"123456789", 9) == 0x31c3);
+  TEST_CHECK(~crc32_update(CRC_START_32, (uint8_t*)"123456789", 9) == 0xcbf43926);
+
+  for (int i = 0; i < 256; i++) {
+    buf[i] = (uint8_t)(i * 167 + 13);
+  }
+
+  // Every length and a few alignments must match byte-at-a-time
+  for (int offset = 0; offset < 8; offset++) {
+    crc16_ref = CRC_START_XMODEM;
+    crc32_ref = CRC_START_32;
+
+    for (int len = 0; len <= 256 - offset; len++) {
+      TEST_CHECK(crc16_update(CRC_START_XMODEM, buf + offset, len) == crc16_ref);
+      TEST_CHECK(crc32_update(CRC_START_32, buf + offset, len) == crc32_ref);
+
+      if (len < 256 - offset) {
+        crc16_ref = ucrc16(buf[offset + len], crc16_ref);
+        crc32_ref = ucrc32(buf[offset + len], crc32_ref);
+      }
+    }
+  }
+
+  TEST_CHECK(zm_calc_data_crc(buf, 256) == crc16_update(CRC_START_XMODEM, buf, 256));
+  TEST_CHECK(zm_calc_data_crc32(buf, 256) == (uint32_t)crc32((char*)buf, 256));
+}
+
+void test_crc_clmul() {
+#ifdef ZCRC_CLMUL
+  static uint8_t buf[4096 + 16];
+
+  if (!zm_crc_have_clmul()) {
+    TEST_MSG("CPU doesn't support PCLMULQDQ; skipping");
+    return;
+  }
+
+  srand(0x5eed);
+
+  for (int i = 0; i < (int)sizeof(buf); i++) {
+    buf[i] = rand();
+  }
+
+  // Random offsets, lengths and starting CRCs must all match the tables
+  for (int i = 0; i < 2000; i++) {
+    int offset = rand() % 16;
+    int len = i < 200 ? i : rand() % 4096;
+    uint32_t crc32_start = i & 1 ? CRC_START_32 : (uint32_t)rand();
+    uint16_t crc16_start = i & 1 ? CRC_START_XMODEM : (uint16_t)rand();
+
+    TEST_CHECK(zm_crc32_clmul(crc32_start, buf + offset, len) == crc32_update(crc32_start, buf + offset, len));
+    TEST_CHECK(zm_crc16_clmul(crc16_start, buf + offset, len) == crc16_update(crc16_start, buf + offset, len));
+  }
+#else
+  TEST_MSG("Built without PCLMULQDQ support; skipping");
+#endif
+}
+
+/* ZDLE-escape a byte into buf for tests; returns bytes written */
+static int escape_byte(uint8_t c, char *buf) {
+  if (c == ZDLE || c == XON || c == XOFF) {
+    buf[0] = ZDLE;
+    buf[1] = c ^ 0x40;
+    return 2;
+  } else {
+    buf[0] = c;
+    return 1;
+  }
+}
+
+void test_read_long_data_block() {
+  static char wire[1024];
+  uint8_t data[400], buf[512];
+  ZMCTX ctx;
+  TESTLINK link;
+  uint16_t len;
+  int n = 0;
+
+  // Long enough for the bulk CRC paths, with escapes scattered through it
+  for (int i = 0; i < 400; i++) {
+    data[i] = (uint8_t)(i * 7);
+    n += escape_byte(data[i], wire + n);
+  }
+
+  wire[n++] = ZDLE;
+  wire[n++] = ZCRCW;
+
+  uint32_t crc = ~crc32_update(crc32_update(CRC_START_32, data, 400), (uint8_t*)"k", 1);
+  n += escape_byte(CRC32_B1(crc), wire + n);
+  n += escape_byte(CRC32_B2(crc), wire + n);
+  n += escape_byte(CRC32_B3(crc), wire + n);
+  n += escape_byte(CRC32_B4(crc), wire + n);
+
+  init_link_ctx(&ctx, &link, wire, n);
+  ctx.in_32bit_block = 1;
+
+  len = 512;
+  TEST_CHECK(zm_read_data_block_ctx(&ctx, buf, &len) == GOT_CRCW);
+  TEST_CHECK(len == 401);
+  TEST_CHECK(memcmp(buf, data, 400) == 0);
+
+  // Flip a bit in the middle
+  wire[200] ^= 0x04;
+  init_link_ctx(&ctx, &link, wire, n);
+  ctx.in_32bit_block = 1;
+
+  len = 512;
+  TEST_CHECK(zm_read_data_block_ctx(&ctx, buf, &len) == BAD_CRC);
+}
+
+static void check_scan_unescaped() {
+  static const uint8_t specials[] = { ZDLE, XON, XOFF };
+  static const int edges[] = { 0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65 };
+  static uint8_t buf[300];
+
+  srand(0xd1e);
+
+  for (int i = 0; i < 500; i++) {
+    int len = rand() % 256;
+    int offset = rand() % 32;
+    int expect = len;
+
+    // Plain bytes, including the high-bit variants which aren't special
+    for (int j = 0; j < len; j++) {
+      do {
+        buf[offset + j] = rand();
+      } while (buf[offset + j] == ZDLE || buf[offset + j] == XON || buf[offset + j] == XOFF);
+    }
+
+    if (len && (i & 3)) {
+      expect = rand() % len;
+      buf[offset + expect] = specials[rand() % 3];
+
+      // Anything after the first doesn't matter
+      if (expect + 1 < len) {
+        buf[offset + len - 1] = ZDLE;
+      }
+    }
+
+    TEST_CHECK(zm_scan_unescaped(buf + offset, len) == expect);
+    TEST_MSG("len %d, offset %d, expected %d", len, offset, expect);
+  }
+
+  // Each stop byte either side of the 16 / 32 byte boundaries, and
+  // lengths that end on them
+  for (int e = 0; e < sizeof(edges) / sizeof(edges[0]); e++) {
+    for (int s = 0; s < sizeof(specials); s++) {
+      memset(buf, 'A', sizeof(buf));
+      buf[edges[e]] = specials[s];
+
+      TEST_CHECK(zm_scan_unescaped(buf, 96) == edges[e]);
+      TEST_MSG("stop 0x%02x at %d", specials[s], edges[e]);
+      TEST_CHECK(zm_scan_unescaped(buf, edges[e]) == edges[e]);
+      TEST_MSG("len %d", edges[e]);
+    }
+  }
+
+  TEST_CHECK(zm_scan_unescaped((uint8_t*)"\x91\x93\x98\x11", 4) == 3);
+}
+
+void test_scan_unescaped() {
+#ifdef ZSCAN_SIMD
+  // Every version the CPU can run, so they're checked against each other
+  uint8_t best = zm_scan_level(ZSCAN_AVX2);
+
+  for (uint8_t level = ZSCAN_SCALAR; level <= best; level++) {
+    TEST_CASE_("level %d", level);
+    TEST_CHECK(zm_scan_level(level) == level);
+    check_scan_unescaped();
+  }
+
+  zm_scan_level(best);
+#else
+  check_scan_unescaped();
+#endif
+}
+
+void test_feed() {
+  static char wire[1024];
+  uint8_t hdr[9], data[300], buf[512];
+  uint8_t types[8];
+  ZRESULT results[8];
+  uint16_t lens[8];
+  ZMCTX ctx;
+  ZEVENT ev;
+  int n = 0, events = 0;
+
+  // Hex ZRINIT, which carries no data...
+  memcpy(wire, "**\x18" "B0100000022ae71\r\n\x11", 21);
+  n = 21;
+
+  // ...then a binary ZDATA header with two subpackets
+  wire[n++] = ZPAD;
+  wire[n++] = ZDLE;
+  wire[n++] = ZBIN32;
+
+  hdr[0] = ZDATA;
+  hdr[1] = hdr[2] = hdr[3] = hdr[4] = 0;
+  uint32_t crc = ~crc32_update(CRC_START_32, hdr, 5);
+  hdr[5] = CRC32_B1(crc);
+  hdr[6] = CRC32_B2(crc);
+  hdr[7] = CRC32_B3(crc);
+  hdr[8] = CRC32_B4(crc);
+
+  for (int i = 0; i < 9; i++) {
+    n += escape_byte(hdr[i], wire + n);
+  }
+
+  for (int i = 0; i < 300; i++) {
+    data[i] = (uint8_t)(i * 13);
+  }
+
+  for (int p = 0; p < 2; p++) {
+    uint8_t *sub = data + p * 150;
+    uint8_t end = p == 0 ? ZCRCG : ZCRCE;
+
+    for (int i = 0; i < 150; i++) {
+      n += escape_byte(sub[i], wire + n);
+    }
+
+    wire[n++] = ZDLE;
+    wire[n++] = end;
+
+    crc = ~crc32_update(crc32_update(CRC_START_32, sub, 150), &end, 1);
+    n += escape_byte(CRC32_B1(crc), wire + n);
+    n += escape_byte(CRC32_B2(crc), wire + n);
+    n += escape_byte(CRC32_B3(crc), wire + n);
+    n += escape_byte(CRC32_B4(crc), wire + n);
+  }
+
+  // And finally a cancel
+  memcpy(wire + n, "\x18\x18\x18\x18\x18", 5);
+  n += 5;
+
+  // Feed it in awkward-sized pieces, so escapes and CRCs get split up
+  zm_feed_init_ctx(&ctx, buf, sizeof(buf));
+
+  for (int pos = 0, chunk = 1; pos < n; chunk = chunk % 7 + 1) {
+    uint16_t len = pos + chunk > n ? n - pos : chunk;
+    uint16_t avail = len;
+
+    while (avail) {
+      uint8_t type = zm_feed_ctx(&ctx, (uint8_t*)wire + pos, &len, &ev);
+      pos += len;
+      avail -= len;
+      len = avail;
+
+      if (type != ZEV_NONE && events < 8) {
+        types[events] = type;
+        results[events] = ev.result;
+        lens[events] = ev.len;
+
+        if (type == ZEV_HEADER) {
+          lens[events] = ev.hdr.type;
+        } else if (type == ZEV_DATA) {
+          TEST_CHECK(memcmp(buf, data + (events - 2) * 150, 150) == 0);
+        }
+
+        events++;
+      }
+    }
+  }
+
+  TEST_CHECK(events == 5);
+  TEST_CHECK(types[0] == ZEV_HEADER && results[0] == OK && lens[0] == ZRINIT);
+  TEST_CHECK(types[1] == ZEV_HEADER && results[1] == OK && lens[1] == ZDATA);
+  TEST_CHECK(types[2] == ZEV_DATA && results[2] == GOT_CRCG && lens[2] == 151);
+  TEST_CHECK(types[3] == ZEV_DATA && results[3] == GOT_CRCE && lens[3] == 151);
+  TEST_CHECK(types[4] == ZEV_CANCEL && results[4] == CANCELLED);
+  TEST_CHECK(ctx.in_32bit_block == 1);
+}
+
+/* Append a hex header to buf, as a receiver would send it */
+static int add_hex_hdr(char *buf, uint8_t type, uint32_t pos) {
+  ZHDR hdr;
+
+  hdr.type = type;
+  hdr.position.p0 = pos & 0xff;
+  hdr.position.p1 = (pos >> 8) & 0xff;
+  hdr.position.p2 = (pos >> 16) & 0xff;
+  hdr.position.p3 = (pos >> 24) & 0xff;
+  zm_calc_hdr_crc(&hdr);
+
+  memcpy(buf, "**\x18", 3);
+  zm_to_hex_header(&hdr, (uint8_t*)buf + 3, HEX_HDR_STR_LEN);
+  return 3 + HEX_HDR_STR_LEN;
+}
+
+void test_resync() {
+  char script[512];
+  ZHDR hdr;
+  int n = 0, bad;
+
+  zm_default_ctx()->peer_hdr = 0;
+
+  // Rest of the bad frame (ZDLEs and all), a ZDATA for the wrong place,
+  // a garbled header and then the one we asked for
+  memcpy(script + n, "AB\x18MCD*\x18hxy", 11);
+  n += 11;
+  n += add_hex_hdr(script + n, ZDATA, 100);
+  bad = n += add_hex_hdr(script + n, ZDATA, 200);
+  script[bad - 6]++;
+  n += add_hex_hdr(script + n, ZDATA, 300);
+  set_buf(script, n);
+
+  TEST_CHECK(zm_resync(300, &hdr) == OK);
+  TEST_CHECK(hdr.type == ZDATA && hdr.position.p0 == 300 % 256 && hdr.position.p1 == 1);
+
+  // Just the one ZRPOS, and nothing for the garbage
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+  TEST_CHECK(sent_buf[4] == '0' && sent_buf[5] == '9');
+
+  // Same for a ZEOF that was sent before the ZRPOS got there
+  n = 0;
+  n += add_hex_hdr(script + n, ZEOF, 2000);
+  n += add_hex_hdr(script + n, ZEOF, 300);
+  set_buf(script, n);
+
+  TEST_CHECK(zm_resync(300, &hdr) == OK);
+  TEST_CHECK(hdr.type == ZEOF);
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+
+  // Still notices a cancel, or running out
+  set_buf("AB\x18\x18\x18\x18\x18", 7);
+  TEST_CHECK(zm_resync(300, &hdr) == CANCELLED);
+
+  set_buf("AB\x18M", 4);
+  TEST_CHECK(zm_resync(300, &hdr) == CLOSED);
+}
+
+static uint8_t attn_sigs[4];
+static int attn_sig_count;
+
+static ZRESULT record_attn_sig(void *user, uint8_t sig) {
+  attn_sigs[attn_sig_count++] = sig;
+  sent_buf[sent_len++] = '|';
+  return OK;
+}
+
+void test_zsinit() {
+  ZMCTX *ctx = zm_default_ctx();
+  char script[32];
+  ZHDR hdr;
+  uint16_t crc = crc16_update(0, (uint8_t*)"\x03\xdd+\x00k", 5);
+
+  // Attn is ^C, break, '+' - CRC16 data subpacket ending ZCRCW
+  memcpy(script, "\x03\xdd+\x00\x18k", 6);
+  script[6] = crc >> 8;
+  script[7] = crc & 0xff;
+  set_buf(script, 8);
+
+  ctx->in_32bit_block = 0;
+  ctx->peer_hdr = 0;
+  hdr.type = ZSINIT;
+  hdr.flags.f0 = TESCCTL;
+
+  TEST_CHECK(zm_read_zsinit(&hdr) == OK);
+  TEST_CHECK(strcmp((char*)ctx->attn, "\x03\xdd+") == 0);
+  TEST_CHECK(ctx->rx_caps & ESCCTL);
+
+  // ACKed
+  TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+  TEST_CHECK(sent_buf[4] == '0' && sent_buf[5] == '3');
+
+  // No hook, no break
+  set_buf("", 0);
+  TEST_CHECK(zm_send_attn() == OK);
+  TEST_CHECK(sent_len == 2 && memcmp(sent_buf, "\x03+", 2) == 0);
+
+  // Goes out (with the break) ahead of the ZRPOS on resync
+  ctx->attn_sig = record_attn_sig;
+  attn_sig_count = 0;
+  set_buf("", 0);
+  TEST_CHECK(zm_resync(0, &hdr) == CLOSED);
+  TEST_CHECK(attn_sig_count == 1 && attn_sigs[0] == ATTNBRK);
+  TEST_CHECK(sent_len == 3 + HEX_HDR_FRAME_LEN);
+  TEST_CHECK(memcmp(sent_buf, "\x03|+**\x18" "B09", 9) == 0);
+
+  ctx->attn_sig = NULL;
+  ctx->attn[0] = 0;
+  ctx->rx_caps = 0;
+  zm_escape_init_ctx(ctx);
+}
+
+void test_timeout() {
+  ZMCTX *ctx = zm_default_ctx();
+  uint8_t buf[16];
+  uint16_t len = sizeof(buf);
+  char script[32];
+  int resends = 0;
+  ZHDR hdr;
+
+  ctx->peer_hdr = 0;
+  ctx->timeouts = 0;
+  ctx->timeout_budget = 10;
+  recv_end = TIMEOUT;
+
+  // We sent ZRPOS (and a ZACK since), then the line goes quiet
+  set_buf("", 0);
+  TEST_CHECK(zm_send_pos_hdr(ZRPOS, 0x1234) == OK);
+  TEST_CHECK(zm_send_pos_hdr(ZACK, 0x5678) == OK);
+
+  for (int i = 0; i < 10; i++) {
+    sent_len = 0;
+    TEST_CHECK(zm_await_header(&hdr) == TIMEOUT);
+    TEST_CHECK(zm_timeout() == OK);
+
+    if (sent_len) {
+      resends++;
+      TEST_CHECK(sent_len == HEX_HDR_FRAME_LEN);
+      TEST_CHECK(memcmp(sent_buf + 4, "0934120000", 10) == 0);
+    }
+  }
+
+  // ... sent again after 1, 2, 4 and 8, then it's over budget
+  TEST_CHECK(resends == 4);
+  TEST_CHECK(zm_timeout() == TIMEOUT);
+
+  // A header starts the count again
+  set_buf(script, add_hex_hdr(script, ZDATA, 0));
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+  TEST_CHECK(ctx->timeouts == 0);
+
+  // The other read paths pass it up too
+  set_buf("AB", 2);
+  TEST_CHECK(zm_read_data_block(buf, &len) == TIMEOUT);
+
+  set_buf("", 0);
+  TEST_CHECK(zm_resync(0, &hdr) == TIMEOUT);
+
+  recv_end = CLOSED;
+  ctx->timeout_budget = 0;
+}
+
+void test_garbage() {
+  ZMCTX *ctx = zm_default_ctx();
+  char script[64];
+  ZHDR hdr;
+  int n;
+
+  TEST_CHECK(zm_scan_zdle((uint8_t*)"login: \x18" "B", 9) == 7);
+  TEST_CHECK(zm_scan_zdle((uint8_t*)"login: ", 7) == 7);
+
+  ctx->peer_hdr = 0;
+  ctx->garbage_max = 16;
+
+  // 20 bytes of console chatter is too much; the header's still there
+  memcpy(script, "Welcome to ttyS0!\r\n", 20);
+  n = 20 + add_hex_hdr(script + 20, ZRQINIT, 0);
+  set_buf(script, n);
+
+  TEST_CHECK(zm_await_header(&hdr) == TOO_MUCH_GARBAGE);
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+  TEST_CHECK(hdr.type == ZRQINIT);
+
+  // Bad escapes where the frame type should be count too
+  for (n = 0; n < 17 * 3; n += 3) {
+    memcpy(script + n, "\x18\x18z", 3);
+  }
+
+  set_buf(script, n);
+  TEST_CHECK(zm_await_header(&hdr) == TOO_MUCH_GARBAGE);
+
+  // Under the limit is fine
+  memcpy(script, "login: ", 7);
+  n = 7 + add_hex_hdr(script + 7, ZRQINIT, 0);
+  set_buf(script, n);
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+
+  // ... and there's no limit by default
+  ctx->garbage_max = 0;
+  memcpy(script, "Welcome to ttyS0!\r\n", 20);
+  n = 20 + add_hex_hdr(script + 20, ZRQINIT, 0);
+  set_buf(script, n);
+  TEST_CHECK(zm_await_header(&hdr) == OK);
+}
+
+static int flow_calls;
+
+static ZRESULT count_flow(void *user) {
+  return ++flow_calls > 1 ? CLOSED : OK;
+}
+
+void test_flow_control() {
+  ZMCTX *ctx = zm_default_ctx();
+
+  ctx->xon_xoff = true;
+
+  // XOFF arrives while we're reading; sending waits for the XON
+  set_buf("\x13Z\x13\x13\x11Y", 6);
+  TEST_CHECK(zm_read_escaped() == 'Z');
+  TEST_CHECK(ctx->xoff);
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == OK);
+  TEST_CHECK(!ctx->xoff);
+  TEST_CHECK(sent_len == 2 && memcmp(sent_buf, "hi", 2) == 0);
+  TEST_CHECK(zm_read_escaped() == 'Y');
+
+  // Anything but XON means it's talking again - and isn't lost
+  set_buf("\x13ZY", 3);
+  TEST_CHECK(zm_read_escaped() == 'Z');
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == OK);
+  TEST_CHECK(zm_read_escaped() == 'Y');
+
+  // Same if the XON never comes (but not if the line's gone)
+  recv_end = TIMEOUT;
+  set_buf("\x13Z", 2);
+  TEST_CHECK(zm_read_escaped() == 'Z');
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == OK);
+  recv_end = CLOSED;
+
+  set_buf("\x13Z", 2);
+  TEST_CHECK(zm_read_escaped() == 'Z');
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == CLOSED);
+  TEST_CHECK(sent_len == 0);
+
+  // Not switched on, so don't wait
+  ctx->xon_xoff = false;
+  set_buf("\x13ZY", 3);
+  TEST_CHECK(zm_read_escaped() == 'Z');
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == OK);
+  TEST_CHECK(sent_len == 2);
+  TEST_CHECK(zm_read_escaped() == 'Y');
+  ctx->xoff = false;
+
+  // Transport's flow hook gets a say before anything goes out
+  ctx->flow = count_flow;
+  flow_calls = 0;
+  set_buf("", 0);
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == OK);
+  TEST_CHECK(zm_send_raw((uint8_t*)"hi", 2) == CLOSED);
+  TEST_CHECK(flow_calls == 2 && sent_len == 2);
+  ctx->flow = NULL;
+}
+
+static uint8_t send_src[2500];
+
+static ZRESULT read_send_src(void *source, uint32_t offset, uint8_t *buf, uint16_t *len) {
+  uint32_t avail = offset < sizeof(send_src) ? sizeof(send_src) - offset : 0;
+
+  if (*len > avail) {
+    *len = avail;
+  }
+
+  memcpy(buf, send_src + offset, *len);
+  return OK;
+}
+
+void test_send_file() {
+  // Event, header type, result, position (header) / offset (data), data length
+  static const struct { uint8_t ev; uint8_t type; ZRESULT result; uint32_t pos; uint16_t len; } expect[] = {
+    { ZEV_HEADER, ZRQINIT,  OK,         0,              0    },
+    { ZEV_HEADER, ZFILE,    OK,         ZCBIN << 24,    0    },
+    { ZEV_DATA,   0,        GOT_CRCW,   0,              15   },
+    { ZEV_HEADER, ZDATA,    OK,         0,              0    },
+    { ZEV_DATA,   0,        GOT_CRCG,   0,              1025 },
+    { ZEV_DATA,   0,        GOT_CRCG,   1024,           1025 },
+    { ZEV_DATA,   0,        GOT_CRCE,   2048,           453  },
+    { ZEV_HEADER, ZEOF,     OK,         2500,           0    },
+    { ZEV_HEADER, ZDATA,    OK,         1500,           0    },
+    { ZEV_DATA,   0,        GOT_CRCG,   1500,           513  },   // Halved after ZRPOS
+    { ZEV_DATA,   0,        GOT_CRCE,   2012,           489  },
+    { ZEV_HEADER, ZEOF,     OK,         2500,           0    },
+    { ZEV_HEADER, ZFIN,     OK,         0,              0    },
+  };
+  char script[256];
+  uint8_t data[1100];
+  ZMCTX ctx;
+  ZEVENT ev;
+  int n = 0, events = 0;
+
+  for (int i = 0; i < sizeof(send_src); i++) {
+    send_src[i] = (uint8_t)(i * 31 + (i >> 8));
+  }
+
+  // Receiver says ZRINIT, start at 0, then wants 1500 onwards again
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZRPOS, 1500);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZFIN, 0);
+  set_buf(script, n);
+
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  TEST_CHECK(zm_sender_end() == OK);
+
+  TEST_CHECK(memcmp(sent_buf, "rz\r", 3) == 0);
+  TEST_CHECK(memcmp(sent_buf + sent_len - 2, "OO", 2) == 0);
+
+  // Now check what went out makes sense to a receiver
+  zm_feed_init_ctx(&ctx, data, sizeof(data));
+
+  for (int pos = 0; pos < sent_len;) {
+    uint16_t len = sent_len - pos;
+    uint8_t type = zm_feed_ctx(&ctx, sent_buf + pos, &len, &ev);
+    pos += len;
+
+    if (type == ZEV_NONE) {
+      continue;
+    }
+
+    TEST_CHECK_(events < 13, "Unexpected event %d", events);
+
+    if (events >= 13) {
+      break;
+    }
+
+    TEST_CHECK(type == expect[events].ev);
+    TEST_CHECK(ev.result == expect[events].result);
+
+    if (type == ZEV_HEADER) {
+      TEST_CHECK(ev.hdr.type == expect[events].type);
+      TEST_CHECK(BTODW(ev.hdr.position.p0, ev.hdr.position.p1,
+                       ev.hdr.position.p2, ev.hdr.position.p3) == expect[events].pos);
+    } else {
+      TEST_CHECK(ev.len == expect[events].len);
+
+      if (events == 2) {
+        TEST_CHECK(memcmp(data, "test.bin\0" "2500\0", 14) == 0);
+      } else {
+        TEST_CHECK(memcmp(data, send_src + expect[events].pos, ev.len - 1) == 0);
+      }
+    }
+
+    events++;
+  }
+
+  TEST_CHECK(events == 13);
+  TEST_CHECK(zm_default_ctx()->stats.rpos == 1);
+  TEST_CHECK(zm_default_ctx()->stats.changes == 1 && zm_default_ctx()->stats.history[0] == 512);
+}
+
+void test_send_mem() {
+  static uint8_t via_read[SENT_LEN];
+  char script[256];
+  int n = 0, read_len;
+
+  // Same script as send_file - should give the same bytes on the wire
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZRPOS, 1500);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+
+  set_buf(script, n);
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  memcpy(via_read, sent_buf, sent_len);
+  read_len = sent_len;
+
+  set_buf(script, n);
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_mem("test.bin", send_src, sizeof(send_src)) == OK);
+
+  TEST_CHECK(sent_len == read_len);
+  TEST_CHECK(memcmp(sent_buf, via_read, read_len) == 0);
+}
+
+/* Feed what the sender sent through a receiver, collecting subpacket lengths */
+static int sent_subpackets(uint8_t *data, uint16_t max, uint16_t *lens, int max_lens) {
+  ZMCTX ctx;
+  ZEVENT ev;
+  int count = 0;
+
+  zm_feed_init_ctx(&ctx, data, max);
+
+  for (int pos = 0; pos < sent_len;) {
+    uint16_t len = sent_len - pos;
+    uint8_t type = zm_feed_ctx(&ctx, sent_buf + pos, &len, &ev);
+    pos += len;
+
+    if (type == ZEV_DATA && count < max_lens) {
+      TEST_CHECK(!IS_ERROR(ev.result));
+      lens[count++] = ev.len;
+    }
+  }
+
+  return count;
+}
+
+void test_send_adaptive() {
+  ZSTATS *stats = &zm_default_ctx()->stats;
+  char script[256];
+  int n = 0;
+
+  for (int i = 0; i < sizeof(send_src); i++) {
+    send_src[i] = (uint8_t)i;
+  }
+
+  // At 64 bytes there's no room to grow. One resend takes it down to
+  // the minimum (32), 16 clean subpackets later it's back to 64, and
+  // the ZNAK after ZEOF takes it down again
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZNAK, 0);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+
+  zm_default_ctx()->block_max = 64;
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  zm_default_ctx()->block_max = 0;
+
+  TEST_CHECK(zm_default_ctx()->block_len == ZMIN_BLOCK_LEN);
+  TEST_CHECK(stats->block_len == ZMIN_BLOCK_LEN);
+  TEST_CHECK(stats->data_bytes == sizeof(send_src) * 2);
+  TEST_CHECK(stats->subpackets == 40 + 16 + 32);
+  TEST_CHECK(stats->rpos == 1);
+  TEST_CHECK(stats->naks == 1);
+  TEST_CHECK(stats->changes == 3);
+  TEST_CHECK(stats->history[0] == ZMIN_BLOCK_LEN && stats->history[1] == 64);
+  TEST_CHECK(stats->history[2] == ZMIN_BLOCK_LEN);
+}
+
+static uint32_t read_end, rereads;
+
+static ZRESULT read_send_src_counted(void *source, uint32_t offset, uint8_t *buf, uint16_t *len) {
+  if (offset < read_end) {
+    rereads++;
+  }
+
+  read_send_src(source, offset, buf, len);
+
+  if (offset + *len > read_end) {
+    read_end = offset + *len;
+  }
+
+  return OK;
+}
+
+void test_send_window() {
+  static uint8_t ring[4096];
+  static uint8_t got[sizeof(send_src)];
+  uint8_t data[ZDATA_BLOCK_LEN + 2];
+  char script[256];
+  int n = 0;
+
+  for (int i = 0; i < sizeof(send_src); i++) {
+    send_src[i] = (uint8_t)(i * 7 + (i >> 8));
+  }
+
+  // 1K window, 128 byte subpackets, so ZCRCQ every 256 bytes. Sender
+  // has to wait at 1024 (gets ZACK 512) and at 1536 (gets ZRPOS 768),
+  // then at 1792 on 64 byte subpackets (ZACK 1600), and then it's clear
+  // to the end.
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZACK, 512);
+  n += add_hex_hdr(script + n, ZRPOS, 768);
+  n += add_hex_hdr(script + n, ZACK, 1600);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+
+  // With a ring that holds it all, one that wraps (and isn't a power
+  // of two), and none
+  for (int r = 0; r < 3; r++) {
+    uint32_t ring_len = r == 0 ? sizeof(ring) : r == 1 ? 1000 : 0;
+    bool with_ring = ring_len != 0;
+    ZMCTX ctx;
+    ZEVENT ev;
+    bool in_data = false;
+    uint32_t at = 0;
+    int crcqs = 0, cut;
+
+    set_buf(script, n);
+    read_end = rereads = 0;
+    memset(got, 0, sizeof(got));
+
+    zm_default_ctx()->block_max = 128;
+    zm_sender_window(1024, with_ring ? ring : NULL, ring_len);
+
+    TEST_CHECK(zm_sender_begin() == OK);
+    TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src_counted, NULL) == OK);
+    TEST_CHECK(zm_default_ctx()->stats.rpos == 1);
+
+    zm_sender_window(0, NULL, 0);
+    zm_default_ctx()->block_max = 0;
+
+    // Only goes back to the file if it hasn't got a ring
+    TEST_CHECK(with_ring ? rereads == 0 : rereads > 0);
+
+    // Receiver puts it all back together. It sent ZRPOS because it
+    // saw an error, so it'd be looking for a header by the time the
+    // ZDATA for 768 arrives - start the parser again there.
+    for (cut = 0; cut < sent_len; cut++) {
+      if (memcmp(sent_buf + cut, "*\x18" "C\x0a\x00\x03\x00\x00", 8) == 0) {
+        break;
+      }
+    }
+
+    TEST_CHECK(cut < sent_len);
+    zm_feed_init_ctx(&ctx, data, sizeof(data));
+
+    for (int pos = 0; pos < sent_len;) {
+      uint16_t len = (pos < cut ? cut : sent_len) - pos;
+      uint8_t type = zm_feed_ctx(&ctx, sent_buf + pos, &len, &ev);
+      pos += len;
+
+      if (pos == cut) {
+        zm_feed_reset_ctx(&ctx);
+      }
+
+      if (type == ZEV_HEADER) {
+        in_data = ev.hdr.type == ZDATA;
+        at = BTODW(ev.hdr.position.p0, ev.hdr.position.p1, ev.hdr.position.p2, ev.hdr.position.p3);
+      } else if (type == ZEV_DATA && in_data) {
+        TEST_CHECK(!IS_ERROR(ev.result) && at + ev.len - 1 <= sizeof(got));
+        memcpy(got + at, data, ev.len - 1);
+        at += ev.len - 1;
+        crcqs += ev.result == GOT_CRCQ;
+      }
+    }
+
+    TEST_CHECK(crcqs > 0);
+    TEST_CHECK(memcmp(got, send_src, sizeof(send_src)) == 0);
+  }
+}
+
+void test_send_rx_buffer() {
+  static const uint16_t want[] = { 301, 301, 301, 101, 301, 301, 301, 101, 301, 201 };
+  uint8_t data[ZDATA_BLOCK_LEN + 2];
+  uint16_t lens[12];
+  char script[256];
+  ZMCTX ctx;
+  ZEVENT ev;
+  int n = 0, zdatas = 0, crcws = 0;
+
+  for (int i = 0; i < sizeof(send_src); i++) {
+    send_src[i] = (uint8_t)(i * 13);
+  }
+
+  // Receiver has a 1000 byte buffer (ZRINIT ZP0 / ZP1), so the sender
+  // ends the frame with ZCRCW there and waits for the ZACK, then starts
+  // a new frame
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24 | 1000);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZACK, 1000);
+  n += add_hex_hdr(script + n, ZACK, 2000);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+
+  zm_default_ctx()->block_max = 300;
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_default_ctx()->rx_buf_len == 1000);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  zm_default_ctx()->block_max = 0;
+
+  // Block 0 is the ZFILE info, then the data
+  TEST_CHECK(sent_subpackets(data, sizeof(data), lens, 12) == 11);
+  TEST_CHECK(memcmp(lens + 1, want, sizeof(want)) == 0);
+
+  zm_feed_init_ctx(&ctx, data, sizeof(data));
+
+  for (int pos = 0; pos < sent_len;) {
+    uint16_t len = sent_len - pos;
+    uint8_t type = zm_feed_ctx(&ctx, sent_buf + pos, &len, &ev);
+    pos += len;
+
+    if (type == ZEV_HEADER && ev.hdr.type == ZDATA) {
+      TEST_CHECK(BTODW(ev.hdr.position.p0, ev.hdr.position.p1,
+                       ev.hdr.position.p2, ev.hdr.position.p3) == zdatas * 1000);
+      zdatas++;
+    } else if (type == ZEV_DATA) {
+      crcws += ev.result == GOT_CRCW;
+    }
+  }
+
+  TEST_CHECK(zdatas == 3);
+  TEST_CHECK(crcws == 3);   // Block 0 ends with one too
+
+  // Buffer smaller than a block caps the subpacket size
+  n = 0;
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24 | CAN8K << 16 | 512);
+  set_buf(script, n);
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_default_ctx()->block_len == 512);
+}
+
+void test_send_big_blocks() {
+  static uint8_t data[ZBIG_BLOCK_LEN + 2];
+  uint16_t lens[8];
+  char script[256];
+  int n = 0;
+
+  for (int i = 0; i < sizeof(send_src); i++) {
+    send_src[i] = (uint8_t)(i * 31 + (i >> 8));
+  }
+
+  // Receiver says CAN8K (ZRINIT F1), so the whole file fits in one
+  // subpacket (after block 0) - through the hook and from memory
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24 | CAN8K << 16);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+
+  for (int mem = 0; mem < 2; mem++) {
+    set_buf(script, n);
+    TEST_CHECK(zm_sender_begin() == OK);
+    TEST_CHECK(zm_default_ctx()->block_len == ZBIG_BLOCK_LEN);
+
+    if (mem) {
+      TEST_CHECK(zm_send_mem("test.bin", send_src, sizeof(send_src)) == OK);
+    } else {
+      TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+    }
+
+    TEST_CHECK(sent_subpackets(data, sizeof(data), lens, 8) == 2);
+    TEST_CHECK(lens[1] == sizeof(send_src) + 1);
+    TEST_CHECK(memcmp(data, send_src, sizeof(send_src)) == 0);
+  }
+
+  // block_max caps it
+  zm_default_ctx()->block_max = 1000;
+  set_buf(script, n);
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  TEST_CHECK(sent_subpackets(data, sizeof(data), lens, 8) == 4);
+  TEST_CHECK(lens[1] == 1001 && lens[2] == 1001 && lens[3] == 501);
+  zm_default_ctx()->block_max = 0;
+
+  // Without CAN8K, it's 1K as usual
+  n = 0;
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_default_ctx()->block_len == ZDATA_BLOCK_LEN);
+}
+
+void test_escape() {
+  static uint8_t in[1000], out[ZESCAPED_MAX(1000)], back[1000];
+  ZMCTX ctx;
+  uint16_t n;
+
+  zm_init_ctx(&ctx);
+
+  n = zm_escape_ctx(&ctx, (uint8_t*)"A\x18" "B\x11\x91@\rX\r", 9, out);
+  TEST_CHECK(n == 13);
+  TEST_CHECK(memcmp(out, "A\x18X" "B\x18\x51\x18\xd1@\x18MX\r", 13) == 0);
+
+  // CR-after-@ works across calls too
+  TEST_CHECK(zm_escape_ctx(&ctx, (uint8_t*)"@", 1, out) == 1);
+  TEST_CHECK(zm_escape_ctx(&ctx, (uint8_t*)"\x8d", 1, out) == 2);
+  TEST_CHECK(memcmp(out, "\x18\xcd", 2) == 0);
+
+  // Other controls and 0x7f / 0xff only when asked for
+  TEST_CHECK(zm_escape_ctx(&ctx, (uint8_t*)"\x01\x81\x7f\xff", 4, out) == 4);
+
+  ctx.rx_caps = ESCCTL | ESC8;
+  zm_escape_init_ctx(&ctx);
+
+  TEST_CHECK(zm_escape_ctx(&ctx, (uint8_t*)"\x01\x81\x7f\xff", 4, out) == 8);
+  TEST_CHECK(memcmp(out, "\x18\x41\x18\xc1\x18l\x18m", 8) == 0);
+
+  // Everything should come back as it went in, with nothing special left bare
+  srand(0xe5c);
+
+  for (int i = 0; i < sizeof(in); i++) {
+    in[i] = rand();
+  }
+
+  n = zm_escape_ctx(&ctx, in, sizeof(in), out);
+  TEST_CHECK(n <= ZESCAPED_MAX(sizeof(in)));
+
+  int len = 0;
+
+  for (int i = 0; i < n; i++) {
+    uint8_t c = out[i];
+
+    if (c == ZDLE) {
+      c = out[++i];
+      back[len++] = c == ZRUB0 ? 0x7f : c == ZRUB1 ? 0xff : c ^ 0x40;
+    } else {
+      TEST_CHECK((c & 0x60) != 0 && (c & 0x7f) != 0x7f);
+      back[len++] = c;
+    }
+  }
+
+  TEST_CHECK(len == sizeof(in));
+  TEST_CHECK(memcmp(in, back, sizeof(in)) == 0);
+
+  // Escape + CRC in one pass gives the same bytes, and the right CRC
+  for (int caps = 0; caps < 2; caps++) {
+    static uint8_t out2[ZESCAPED_MAX(1000)];
+    uint32_t crc = caps ? CRC_START_32 : CRC_START_XMODEM;
+
+    ctx.rx_caps = caps ? CANFC32 : 0;
+    zm_escape_init_ctx(&ctx);
+
+    n = zm_escape_ctx(&ctx, in, sizeof(in), out);
+    TEST_CHECK(zm_escape_crc_ctx(&ctx, in, sizeof(in), out2, &crc) == n);
+    TEST_CHECK(memcmp(out, out2, n) == 0);
+
+    if (caps) {
+      TEST_CHECK(~crc == zm_calc_data_crc32(in, sizeof(in)));
+    } else {
+      TEST_CHECK(crc == zm_calc_data_crc(in, sizeof(in)));
+    }
+  }
+}
+
+void test_parse_file_info() {
+  ZFILEINFO info;
+
+  // Everything, as lrzsz sends it (and with the frame end on the back)
+  uint8_t full[] = "dir/file.bin\0" "123456 14165337060 100644 0 3 654321\0k";
+  TEST_CHECK(zm_parse_file_info(full, sizeof(full) - 1, &info) == OK);
+  TEST_CHECK(strcmp(info.name, "dir/file.bin") == 0);
+  TEST_CHECK(info.present == (ZFI_SIZE | ZFI_MTIME | ZFI_MODE | ZFI_SERIAL | ZFI_FILES_LEFT | ZFI_BYTES_LEFT));
+  TEST_CHECK(info.size == 123456);
+  TEST_CHECK(info.mtime == 014165337060);
+  TEST_CHECK(info.mode == 0100644);
+  TEST_CHECK(info.serial == 0);
+  TEST_CHECK(info.files_left == 3);
+  TEST_CHECK(info.bytes_left == 654321);
+
+  // Just name and size (as our sender does)
+  uint8_t some[] = "test.bin\0" "2500\0k";
+  TEST_CHECK(zm_parse_file_info(some, sizeof(some) - 1, &info) == OK);
+  TEST_CHECK(strcmp(info.name, "test.bin") == 0);
+  TEST_CHECK(info.present == ZFI_SIZE);
+  TEST_CHECK(info.size == 2500);
+
+  // Just the name
+  uint8_t name[] = "test.bin\0k";
+  TEST_CHECK(zm_parse_file_info(name, sizeof(name) - 1, &info) == OK);
+  TEST_CHECK(info.present == 0);
+
+  // Broken
+  TEST_CHECK(zm_parse_file_info((uint8_t*)"test.bin", 8, &info) == CORRUPTED);
+  uint8_t big[] = "test.bin\0" "4294967296\0k";
+  TEST_CHECK(zm_parse_file_info(big, sizeof(big) - 1, &info) == OUT_OF_RANGE);
+}
+
+void test_send_resume() {
+  char script[256];
+  uint8_t data[1100];
+  ZMCTX ctx;
+  ZEVENT ev;
+  int n = 0, headers = 0;
+  uint32_t crc = ~crc32_update(CRC_START_32, send_src, 1000);
+
+  // Receiver has 1000 bytes already - checks them, then asks for the rest
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZCRC, 1000);
+  n += add_hex_hdr(script + n, ZRPOS, 1000);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+
+  zm_default_ctx()->file_conv = ZCRESUM;
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  zm_default_ctx()->file_conv = 0;
+
+  zm_feed_init_ctx(&ctx, data, sizeof(data));
+
+  for (int pos = 0; pos < sent_len;) {
+    uint16_t len = sent_len - pos;
+    uint8_t type = zm_feed_ctx(&ctx, sent_buf + pos, &len, &ev);
+    uint32_t value = BTODW(ev.hdr.position.p0, ev.hdr.position.p1,
+                           ev.hdr.position.p2, ev.hdr.position.p3);
+    pos += len;
+
+    if (type != ZEV_HEADER) {
+      continue;
+    }
+
+    switch (headers++) {
+    case 1:
+      TEST_CHECK(ev.hdr.type == ZFILE && ev.hdr.flags.f0 == ZCRESUM);
+      break;
+    case 2:
+      TEST_CHECK(ev.hdr.type == ZCRC && value == crc);
+      break;
+    case 3:
+      TEST_CHECK(ev.hdr.type == ZDATA && value == 1000);
+      break;
+    }
+  }
+
+  TEST_CHECK(headers == 5);
+}
+
+static char *peek_arrives;
+
+static bool peek_after_1500(void *user) {
+  if (sent_len >= 1500 && buf_limit < peek_arrives) {
+    buf_limit = peek_arrives;
+  }
+
+  return buf_ptr < buf_limit;
+}
+
+void test_send_peek() {
+  char script[256];
+  int n = 0, held, rewound = -1, eofs = 0;
+
+  // Streaming (no window), the ZRPOS for 1024 turns up once 1500 bytes
+  // have gone out - with a peek hook, the sender goes back there and
+  // then, rather than carrying on to ZEOF first
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  held = n;
+  n += add_hex_hdr(script + n, ZRPOS, 1024);
+  peek_arrives = recv_buf + n;
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+  buf_limit = recv_buf + held;
+
+  zm_default_ctx()->peek = peek_after_1500;
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  TEST_CHECK(zm_default_ctx()->stats.rpos == 1);
+  zm_default_ctx()->peek = NULL;
+
+  for (int i = 0; i < sent_len - 8; i++) {
+    if (memcmp(sent_buf + i, "*\x18" "C\x0a\x00\x04\x00\x00", 8) == 0) {
+      rewound = i;
+    } else if (memcmp(sent_buf + i, "*\x18" "C\x0b\xc4\x09\x00\x00", 8) == 0) {
+      TEST_CHECK(i > rewound && rewound > 0);
+      eofs++;
+    }
+  }
+
+  TEST_CHECK(rewound > 0 && eofs == 1);
+}
+
+void test_send_zcrc_storm() {
+  char script[(ZSEND_STRAYS + 1) * 24];
+  int n = 0;
+
+  // A receiver stuck asking for the CRC doesn't keep the sender forever
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+
+  for (int i = 0; i < ZSEND_STRAYS; i++) {
+    n += add_hex_hdr(script + n, ZCRC, 1000);
+  }
+
+  set_buf(script, n);
+
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == BAD_FRAME_TYPE);
+}
+
+void test_send_eof_nak() {
+  char script[256];
+  int n = 0, eofs = 0;
+
+  // Receiver NAKs a garbled ZEOF, so it's sent again
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+  n += add_hex_hdr(script + n, ZNAK, 0);
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  set_buf(script, n);
+
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == OK);
+  TEST_CHECK(zm_default_ctx()->stats.naks == 1);
+
+  for (int i = 0; i < sent_len - 8; i++) {
+    if (memcmp(sent_buf + i, "*\x18" "C\x0b\xc4\x09\x00\x00", 8) == 0) {
+      eofs++;
+    }
+  }
+
+  TEST_CHECK(eofs == 2);
+}
+
+void test_send_eof_storm() {
+  char script[(ZSEND_STRAYS + ZSEND_RETRIES + 2) * 24];
+  int n = 0;
+
+  // Nor does one that answers ZEOF with anything but ZRINIT / ZRPOS
+  n += add_hex_hdr(script + n, ZRINIT, CANFC32 << 24);
+  n += add_hex_hdr(script + n, ZRPOS, 0);
+
+  for (int i = 0; i < ZSEND_STRAYS + ZSEND_RETRIES; i++) {
+    n += add_hex_hdr(script + n, ZACK, sizeof(send_src));
+  }
+
+  set_buf(script, n);
+
+  TEST_CHECK(zm_sender_begin() == OK);
+  TEST_CHECK(zm_send_file("test.bin", sizeof(send_src), read_send_src, NULL) == BAD_FRAME_TYPE);
+}
+
 TEST_LIST = {
   { "recv_buffer",          test_recv_buffer      },
   { "IS_ERROR",             test_is_error         },
@@ -409,5 +1841,32 @@ TEST_LIST = {
   { "calc_hdr_crc",         test_calc_hdr_crc     },
   { "to_hex_header",        test_to_hex_header    },
   { "test_read_escaped",    test_read_escaped     },
+  { "read_data_block",      test_read_data_block  },
+  { "send_hex_hdr",         test_send_hex_hdr     },
+  { "send_bin_hdr",         test_send_bin_hdr     },
+  { "resync",               test_resync           },
+  { "zsinit",               test_zsinit           },
+  { "timeout",              test_timeout          },
+  { "garbage",              test_garbage          },
+  { "flow_control",         test_flow_control     },
+  { "ctx_sessions",         test_ctx_sessions     },
+  { "read_long_data_block", test_read_long_data_block },
+  { "crc_update",           test_crc_update       },
+  { "scan_unescaped",       test_scan_unescaped   },
+  { "crc_clmul",            test_crc_clmul        },
+  { "feed",                 test_feed             },
+  { "send_file",            test_send_file        },
+  { "send_mem",             test_send_mem         },
+  { "send_resume",          test_send_resume      },
+  { "send_peek",            test_send_peek        },
+  { "send_zcrc_storm",      test_send_zcrc_storm  },
+  { "send_eof_nak",         test_send_eof_nak     },
+  { "send_eof_storm",       test_send_eof_storm   },
+  { "send_big_blocks",      test_send_big_blocks  },
+  { "send_rx_buffer",       test_send_rx_buffer   },
+  { "send_adaptive",        test_send_adaptive    },
+  { "send_window",          test_send_window      },
+  { "escape",               test_escape           },
+  { "parse_file_info",      test_parse_file_info  },
   { NULL, NULL }
 };
@@ -0,0 +1,170 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Bulk CRC routines with runtime CPU dispatch
+ * ------------------------------------------------------------
+ */
+
+#include "zcrc.h"
+#include "crc16.h"
+#include "crc32.h"
+
+#ifdef ZCRC_CLMUL
+#include <immintrin.h>
+
+#define CLMUL_TARGET      __attribute__((target("pclmul,ssse3")))
+
+/* Below this, the table code is quicker than setting up the fold */
+#define CLMUL_MIN_LEN     64
+
+/*
+ * Folding constants. Each 128-bit block is split into two 64-bit halves,
+ * and each half is multiplied by x^n mod P for the distance it needs to
+ * move forward (one block, or four for the main loop). Because the
+ * constants are already reduced, the products fit comfortably in 128 bits
+ * and the accumulator stays congruent to the data folded so far.
+ *
+ * CRC32 is bit-reflected, so the constants are too (and are one power
+ * lower, as a reflected carry-less multiply is implicitly shifted by one).
+ */
+#define K32_LO_1          0x65673b4600000000ULL   /* x^191 mod P, reflected   */
+#define K32_HI_1          0x9ba54c6f00000000ULL   /* x^127 mod P, reflected   */
+#define K32_LO_4          0x653d982200000000ULL   /* x^575 mod P, reflected   */
+#define K32_HI_4          0xcad38e8f00000000ULL   /* x^511 mod P, reflected   */
+
+#define K16_HI_1          0x650bULL               /* x^192 mod P              */
+#define K16_LO_1          0xaefcULL               /* x^128 mod P              */
+#define K16_HI_4          0x8832ULL               /* x^576 mod P              */
+#define K16_LO_4          0x13fcULL               /* x^512 mod P              */
+
+static bool have_clmul = false;
+
+__attribute__((constructor)) static void init_clmul() {
+  __builtin_cpu_init();
+  have_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+CLMUL_TARGET static inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+/*
+ * Folds len (>= 64) bytes down to a single 128-bit block with the same
+ * remainder. Leaves buf / len pointing at the unfolded tail.
+ */
+CLMUL_TARGET static inline __m128i fold_all(__m128i x0, const uint8_t **buf, unsigned long *len,
+                                            __m128i k1, __m128i k4, __m128i swap) {
+  const uint8_t *p = *buf;
+  unsigned long n = *len;
+
+  __m128i x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x10)), swap);
+  __m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x20)), swap);
+  __m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x30)), swap);
+  p += 64;
+  n -= 64;
+
+  while (n >= 64) {
+    x0 = fold(x0, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x00)), swap));
+    x1 = fold(x1, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x10)), swap));
+    x2 = fold(x2, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x20)), swap));
+    x3 = fold(x3, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0x30)), swap));
+    p += 64;
+    n -= 64;
+  }
+
+  x0 = fold(x0, k1, x1);
+  x0 = fold(x0, k1, x2);
+  x0 = fold(x0, k1, x3);
+
+  while (n >= 16) {
+    x0 = fold(x0, k1, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), swap));
+    p += 16;
+    n -= 16;
+  }
+
+  *buf = p;
+  *len = n;
+  return x0;
+}
+
+CLMUL_TARGET uint32_t zm_crc32_clmul(uint32_t crc, const uint8_t *buf, unsigned long len) {
+  uint8_t folded[16];
+
+  if (len < CLMUL_MIN_LEN) {
+    return crc32_update(crc, buf, len);
+  }
+
+  // Reflected - data is already in the right order, so "swap" is identity
+  const __m128i swap = _mm_set_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  const __m128i k1 = _mm_set_epi64x(K32_HI_1, K32_LO_1);
+  const __m128i k4 = _mm_set_epi64x(K32_HI_4, K32_LO_4);
+
+  // Initial CRC goes into the first four bytes
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)buf), _mm_cvtsi32_si128(crc));
+  x0 = fold_all(x0, &buf, &len, k1, k4, swap);
+
+  // The folded block is just a (much shorter) message with the same CRC
+  _mm_storeu_si128((__m128i*)folded, x0);
+  crc = crc32_update(0, folded, 16);
+
+  return crc32_update(crc, buf, len);
+}
+
+CLMUL_TARGET uint16_t zm_crc16_clmul(uint16_t crc, const uint8_t *buf, unsigned long len) {
+  uint8_t folded[16];
+
+  if (len < CLMUL_MIN_LEN) {
+    return crc16_update(crc, buf, len);
+  }
+
+  // Not reflected - byte-swap each block so the first byte is most significant
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k1 = _mm_set_epi64x(K16_HI_1, K16_LO_1);
+  const __m128i k4 = _mm_set_epi64x(K16_HI_4, K16_LO_4);
+
+  // Initial CRC goes into the first two bytes
+  __m128i x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)buf), swap);
+  x0 = _mm_xor_si128(x0, _mm_set_epi64x((uint64_t)crc << 48, 0));
+  x0 = fold_all(x0, &buf, &len, k1, k4, swap);
+
+  _mm_storeu_si128((__m128i*)folded, _mm_shuffle_epi8(x0, swap));
+  crc = crc16_update(0, folded, 16);
+
+  return crc16_update(crc, buf, len);
+}
+
+bool zm_crc_have_clmul() {
+  return have_clmul;
+}
+
+uint32_t zm_crc32_update(uint32_t crc, const uint8_t *buf, unsigned long len) {
+  return have_clmul ? zm_crc32_clmul(crc, buf, len) : crc32_update(crc, buf, len);
+}
+
+uint16_t zm_crc16_update(uint16_t crc, const uint8_t *buf, unsigned long len) {
+  return have_clmul ? zm_crc16_clmul(crc, buf, len) : crc16_update(crc, buf, len);
+}
+#else
+bool zm_crc_have_clmul() {
+  return false;
+}
+
+uint32_t zm_crc32_update(uint32_t crc, const uint8_t *buf, unsigned long len) {
+  return crc32_update(crc, buf, len);
+}
+
+uint16_t zm_crc16_update(uint16_t crc, const uint8_t *buf, unsigned long len) {
+  return crc16_update(crc, buf, len);
+}
+#endif
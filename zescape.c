@@ -0,0 +1,171 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * ZDLE escaping for outgoing data
+ * ------------------------------------------------------------
+ */
+
+#ifndef ZEMBEDDED
+#include <string.h>
+#else
+#include "embedded.h"
+#endif
+
+#include "zescape.h"
+#include "zcrc.h"
+
+#include "crc16.h"
+#include "crc32.h"
+
+/*
+ * Table entries are 0 for bytes that go out as-is, ESC_IF_AT for CR
+ * (only escaped after '@'), or the byte to send after ZDLE. Real
+ * escapes are never 0 or 1, so there's no ambiguity.
+ */
+#define ESC_IF_AT         0x01
+
+void zm_escape_init_ctx(ZMCTX *ctx) {
+  uint8_t *table = ctx->esc_table;
+
+  for (int c = 0; c < 256; c++) {
+    if ((ctx->rx_caps & ESCCTL) && (c & 0x60) == 0) {
+      table[c] = c ^ 0x40;
+      continue;
+    }
+
+    switch (c & 0x7f) {
+    case ZDLE:
+    case 0x10:
+    case XON:
+    case XOFF:
+      table[c] = c ^ 0x40;
+      break;
+    case CR:
+      table[c] = ESC_IF_AT;
+      break;
+    default:
+      table[c] = 0;
+    }
+  }
+
+  if (ctx->rx_caps & ESC8) {
+    for (int c = 0x80; c < 0xa0; c++) {
+      table[c] = c ^ 0x40;
+    }
+
+    table[0x7f] = ZRUB0;
+    table[0xff] = ZRUB1;
+  }
+
+  ctx->esc_last = 0;
+}
+
+// What (if any) CRC escape() keeps up to date as it goes
+#define CRC_NONE          0
+#define CRC_16            1
+#define CRC_32            2
+
+/*
+ * Does the work for both zm_escape_ctx and zm_escape_crc_ctx. Called
+ * with a constant crc_mode, so once inlined the plain version doesn't
+ * pay for the CRC checks.
+ *
+ * Runs of clean bytes are CRC'd straight after they're copied (while
+ * they're still in cache) with zm_crc*_update, so long runs get the
+ * fast CRC code; escaped bytes are done one at a time.
+ */
+static inline uint16_t escape(ZMCTX *ctx, const uint8_t *in, uint16_t len, uint8_t *out,
+                              uint32_t *crc, const int crc_mode) {
+  // ZDLE is always escaped, so a zero here means a statically set up
+  // session (e.g. the default one) that's never had its table built
+  if (!ctx->esc_table[ZDLE]) {
+    zm_escape_init_ctx(ctx);
+  }
+
+  const uint8_t *table = ctx->esc_table;
+  const uint8_t *end = in + len;
+  uint8_t *start = out;
+  uint8_t last = ctx->esc_last;
+  uint32_t c32 = crc_mode == CRC_32 ? *crc : 0;
+  uint16_t c16 = crc_mode == CRC_16 ? (uint16_t)*crc : 0;
+
+  while (in < end) {
+    const uint8_t *run = in;
+
+    while (in < end && !table[*in]) {
+      in++;
+    }
+
+    if (in > run) {
+#ifdef ZEMBEDDED
+      for (const uint8_t *p = run; p < in; p++) {
+        *out++ = *p;
+      }
+#else
+      memcpy(out, run, in - run);
+      out += in - run;
+#endif
+      last = in[-1];
+
+      if (crc_mode == CRC_32) {
+        c32 = zm_crc32_update(c32, run, in - run);
+      } else if (crc_mode == CRC_16) {
+        c16 = zm_crc16_update(c16, run, in - run);
+      }
+    }
+
+    if (in == end) {
+      break;
+    }
+
+    uint8_t c = *in++;
+    uint8_t esc = table[c];
+
+    if (crc_mode == CRC_32) {
+      c32 = ucrc32(c, c32);
+    } else if (crc_mode == CRC_16) {
+      c16 = ucrc16(c, c16);
+    }
+
+    if (esc == ESC_IF_AT) {
+      if ((last & 0x7f) != '@') {
+        *out++ = last = c;
+        continue;
+      }
+
+      esc = c ^ 0x40;
+    }
+
+    *out++ = ZDLE;
+    *out++ = last = esc;
+  }
+
+  if (crc_mode == CRC_32) {
+    *crc = c32;
+  } else if (crc_mode == CRC_16) {
+    *crc = c16;
+  }
+
+  ctx->esc_last = last;
+  return out - start;
+}
+
+uint16_t zm_escape_ctx(ZMCTX *ctx, const uint8_t *in, uint16_t len, uint8_t *out) {
+  return escape(ctx, in, len, out, NULL, CRC_NONE);
+}
+
+uint16_t zm_escape_crc_ctx(ZMCTX *ctx, const uint8_t *in, uint16_t len, uint8_t *out, uint32_t *crc) {
+  if (ctx->rx_caps & CANFC32) {
+    return escape(ctx, in, len, out, crc, CRC_32);
+  } else {
+    return escape(ctx, in, len, out, crc, CRC_16);
+  }
+}
@@ -0,0 +1,474 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Push-style (non-blocking) receive parser
+ * ------------------------------------------------------------
+ */
+
+#ifdef ZDEBUG
+#include <stdio.h>
+#endif
+
+#ifndef ZEMBEDDED
+#include <string.h>
+#else
+#include "embedded.h"
+#endif
+
+#include "zfeed.h"
+#include "zserial.h"
+#include "zheaders.h"
+#include "znumbers.h"
+#include "zscan.h"
+#include "zcrc.h"
+
+#include "crc16.h"
+#include "crc32.h"
+
+// Parser states
+#define FS_HUNT           0x00          /* Waiting for ZDLE that starts a header            */
+#define FS_TYPE           0x01          /* Got ZDLE, waiting for header type                */
+#define FS_HEX            0x02          /* Collecting hex header digits                     */
+#define FS_HEX_CRLF       0x03          /* Hex header done, waiting for CR/LF               */
+#define FS_BIN16          0x04          /* Collecting binary header with CRC16              */
+#define FS_BIN32          0x05          /* Collecting binary header with CRC32              */
+#define FS_DATA           0x06          /* Collecting data subpacket                        */
+#define FS_CRC            0x07          /* Collecting data subpacket CRC                    */
+
+/* decode() consumed the byte but has nothing to return yet */
+#define NO_CHAR           OK
+
+#define HEX_DIGITS        ((ZHDR_SIZE - 2) * 2)
+
+/* Update the running CRC for the current block type with one byte */
+#define UPDATE_CRC(ctx, crc, c)   ((ctx)->in_32bit_block ? (uint32_t)ucrc32((c), (crc)) \
+                                                         : (uint16_t)ucrc16((c), (crc)))
+
+/*
+ * Same as zm_read_escaped, but a byte at a time. Any partial escape
+ * is kept in the parser state.
+ */
+static ZRESULT decode(ZFEED *f, uint8_t c) {
+  if (f->cans == 0) {
+    if (NONCONTROL(c)) {
+      return c;
+    }
+
+    switch (c) {
+    case XON:
+    case XOFF:
+      return NO_CHAR;
+    case ZDLE:
+      f->cans = 1;
+      return NO_CHAR;
+    default:
+      return c;
+    }
+  }
+
+  // In an escape - see zm_read_escaped for how the CAN counting works
+  if (c == CAN) {
+    if (++f->cans == 5) {
+      DEBUGF("  >> FEED: Got five CANs\n");
+      f->cans = 0;
+      return CANCELLED;
+    } else {
+      return NO_CHAR;
+    }
+  }
+
+  f->cans = 0;
+
+  switch (c) {
+  case ZCRCE:
+    return GOT_CRCE;
+  case ZCRCG:
+    return GOT_CRCG;
+  case ZCRCQ:
+    return GOT_CRCQ;
+  case ZCRCW:
+    return GOT_CRCW;
+  case ZRUB0:
+    return 0x7f;
+  case ZRUB1:
+    return 0xff;
+  default:
+    if ((c & 0x60) == 0x40) {
+      return c ^ 0x40;
+    }
+  }
+
+  DEBUGF("  >> FEED: Got bad control character 0x%02x\n", c);
+  return BAD_ESCAPE;
+}
+
+static bool has_data(uint8_t type) {
+  switch (type) {
+  case ZSINIT:
+  case ZFILE:
+  case ZDATA:
+  case ZCOMMAND:
+  case ZSTDERR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void start_data(ZMCTX *ctx) {
+  ZFEED *f = &ctx->feed;
+
+  f->state = FS_DATA;
+  f->data_len = 0;
+  f->crc = ctx->in_32bit_block ? CRC_START_32 : CRC_START_XMODEM;
+}
+
+/* Finish a header; raw holds the (decoded) header bytes */
+static uint8_t header_event(ZMCTX *ctx, ZEVENT *ev, ZRESULT result) {
+  ZFEED *f = &ctx->feed;
+  uint8_t *ptr = (uint8_t*)&ev->hdr;
+
+  memset(&ev->hdr, 0xc0, sizeof(ZHDR));
+
+  for (int i = 0; i < f->count && i < ZHDR_SIZE; i++) {
+    *ptr++ = f->raw[i];
+  }
+
+  ev->type = ZEV_HEADER;
+  ev->result = result;
+
+  DEBUGF("  >> FEED: Header event [0x%04x]\n", result);
+  DEBUG_DUMPHDR_R((&ev->hdr));
+
+  if (result == OK && has_data(ev->hdr.type)) {
+    start_data(ctx);
+  } else {
+    f->state = FS_HUNT;
+  }
+
+  return ZEV_HEADER;
+}
+
+static uint8_t data_event(ZMCTX *ctx, ZEVENT *ev, ZRESULT result) {
+  ZFEED *f = &ctx->feed;
+
+  ev->type = ZEV_DATA;
+  ev->result = result;
+  ev->len = f->data_len;
+
+  DEBUGF("  >> FEED: Data event [0x%04x] (%d byte(s))\n", result, f->data_len);
+
+  // Frame continues after ZCRCG / ZCRCQ; anything else needs a new header
+  if (result == GOT_CRCG || result == GOT_CRCQ) {
+    start_data(ctx);
+  } else {
+    f->state = FS_HUNT;
+  }
+
+  return ZEV_DATA;
+}
+
+static uint8_t cancel_event(ZMCTX *ctx, ZEVENT *ev) {
+  ctx->feed.state = FS_HUNT;
+  ev->type = ZEV_CANCEL;
+  ev->result = CANCELLED;
+  return ZEV_CANCEL;
+}
+
+/* All hex digits are in - decode them in place and check the CRC */
+static ZRESULT finish_hex(ZFEED *f) {
+  uint16_t crc = CRC_START_XMODEM;
+
+  for (int i = 0; i < ZHDR_SIZE - 2; i++) {
+    ZRESULT b = zm_hex_to_byte(f->raw[i * 2], f->raw[i * 2 + 1]);
+
+    if (IS_ERROR(b)) {
+      return b;
+    }
+
+    f->raw[i] = ZVALUE(b);
+
+    if (i < ZHDR_SIZE - 4) {
+      crc = ucrc16(f->raw[i], crc);
+    }
+  }
+
+  f->count = ZHDR_SIZE - 2;
+  return CRC(f->raw[5], f->raw[6]) == crc ? OK : BAD_CRC;
+}
+
+static ZRESULT finish_binary(ZFEED *f, bool crc32) {
+  if (crc32) {
+    uint32_t crc = CRC_START_32;
+
+    for (int i = 0; i < ZHDR_SIZE - 4; i++) {
+      crc = ucrc32(f->raw[i], crc);
+    }
+
+    return CRC32(f->raw[5], f->raw[6], f->raw[7], f->raw[8]) == ~crc ? OK : BAD_CRC;
+  } else {
+    uint16_t crc = CRC_START_XMODEM;
+
+    for (int i = 0; i < ZHDR_SIZE - 4; i++) {
+      crc = ucrc16(f->raw[i], crc);
+    }
+
+    return CRC(f->raw[5], f->raw[6]) == crc ? OK : BAD_CRC;
+  }
+}
+
+/* Check the CRC that was just received against the running one */
+static ZRESULT finish_data(ZMCTX *ctx) {
+  ZFEED *f = &ctx->feed;
+
+  if (ctx->in_32bit_block) {
+    uint32_t recv_crc = CRC32(f->raw[0], f->raw[1], f->raw[2], f->raw[3]);
+    return recv_crc == ~f->crc ? (FIN | f->frameend) : BAD_CRC;
+  } else {
+    uint16_t recv_crc = CRC(f->raw[0], f->raw[1]);
+    return recv_crc == f->crc ? (FIN | f->frameend) : BAD_CRC;
+  }
+}
+
+/*
+ * Copy as much of a run of plain bytes as possible straight into the
+ * data buffer. Returns the number of bytes used.
+ */
+static uint16_t bulk_data(ZMCTX *ctx, const uint8_t *bytes, uint16_t len) {
+  ZFEED *f = &ctx->feed;
+  uint16_t space = f->data_max - f->data_len;
+  uint16_t run = zm_scan_unescaped(bytes, len < space ? len : space);
+  uint8_t *dst = f->data + f->data_len;
+
+#ifdef ZEMBEDDED
+  for (uint16_t i = 0; i < run; i++) {
+    dst[i] = bytes[i];
+  }
+#else
+  memcpy(dst, bytes, run);
+#endif
+
+  if (ctx->in_32bit_block) {
+    f->crc = zm_crc32_update(f->crc, dst, run);
+  } else {
+    f->crc = zm_crc16_update(f->crc, dst, run);
+  }
+
+  f->data_len += run;
+  return run;
+}
+
+void zm_feed_init_ctx(ZMCTX *ctx, uint8_t *data_buf, uint16_t data_len) {
+  memset(&ctx->feed, 0, sizeof(ZFEED));
+  ctx->feed.data = data_buf;
+  ctx->feed.data_max = data_len;
+}
+
+void zm_feed_reset_ctx(ZMCTX *ctx) {
+  ctx->feed.state = FS_HUNT;
+  ctx->feed.cans = 0;
+  ctx->feed.count = 0;
+}
+
+uint8_t zm_feed_ctx(ZMCTX *ctx, const uint8_t *bytes, uint16_t *len, ZEVENT *ev) {
+  ZFEED *f = &ctx->feed;
+  uint16_t max = *len;
+  uint16_t pos = 0;
+  ZRESULT c;
+
+  // Wherever we return from, *len needs to say how far we got
+#define EMIT(e)   do { uint8_t __ev = (e); *len = pos; return __ev; } while (0)
+
+  while (pos < max) {
+    uint8_t b;
+
+    if (f->state == FS_DATA && f->cans == 0) {
+      pos += bulk_data(ctx, bytes + pos, max - pos);
+
+      if (pos == max) {
+        break;
+      }
+    }
+
+    b = bytes[pos++];
+
+    switch (f->state) {
+    case FS_HUNT:
+      // Anything other than ZDLE (ZPAD, XON, line noise) is skipped
+      if (b == ZDLE) {
+        f->state = FS_TYPE;
+        f->cans = 1;
+      }
+
+      continue;
+
+    case FS_TYPE:
+      if (b == CAN) {
+        if (++f->cans == 5) {
+          f->cans = 0;
+          EMIT(cancel_event(ctx, ev));
+        }
+
+        continue;
+      } else if (f->cans > 1) {
+        // Escaped junk rather than a header
+        f->cans = 0;
+        f->state = FS_HUNT;
+        continue;
+      } else if (b == XON || b == XOFF) {
+        continue;
+      }
+
+      f->cans = 0;
+      f->count = 0;
+
+      switch (b) {
+      case ZHEX:
+        f->state = FS_HEX;
+        continue;
+      case ZBIN16:
+        f->state = FS_BIN16;
+        continue;
+      case ZBIN32:
+        f->state = FS_BIN32;
+        continue;
+      default:
+        DEBUGF("  >> FEED: Got bad frame type '%c' [%02x]\n", b, b);
+        EMIT(header_event(ctx, ev, BAD_FRAME_TYPE));
+      }
+
+    case FS_HEX:
+      f->raw[f->count++] = b;
+
+      if (f->count == HEX_DIGITS) {
+        c = finish_hex(f);
+
+        if (c == OK) {
+          ctx->in_32bit_block = 0;
+          f->state = FS_HEX_CRLF;
+          f->cans = 0;
+        } else {
+          f->count = 0;
+          EMIT(header_event(ctx, ev, c));
+        }
+      }
+
+      continue;
+
+    case FS_HEX_CRLF:
+      switch (b) {
+      case XON:
+      case XOFF:
+        continue;
+      case CR:
+      case CR | 0x80:
+        if (f->cans++ == 0) {
+          continue;
+        } else {
+          EMIT(header_event(ctx, ev, CORRUPTED));
+        }
+      case LF:
+      case LF | 0x80:
+        EMIT(header_event(ctx, ev, OK));
+      default:
+        EMIT(header_event(ctx, ev, CORRUPTED));
+      }
+
+    case FS_BIN16:
+    case FS_BIN32:
+      c = decode(f, b);
+
+      if (c == NO_CHAR) {
+        continue;
+      } else if (c == CANCELLED) {
+        EMIT(cancel_event(ctx, ev));
+      } else if (IS_ERROR(c)) {
+        EMIT(header_event(ctx, ev, c));
+      }
+
+      f->raw[f->count++] = ZVALUE(c);
+
+      if (f->state == FS_BIN16 && f->count == ZHDR_SIZE - 2) {
+        ctx->in_32bit_block = 0;
+
+        if ((c = finish_binary(f, false)) == OK && ctx->peer_hdr != ZBIN32) {
+          ctx->peer_hdr = ZBIN16;
+        }
+
+        EMIT(header_event(ctx, ev, c));
+      } else if (f->state == FS_BIN32 && f->count == ZHDR_SIZE) {
+        ctx->in_32bit_block = 1;
+
+        if ((c = finish_binary(f, true)) == OK) {
+          ctx->peer_hdr = ZBIN32;
+        }
+
+        EMIT(header_event(ctx, ev, c));
+      }
+
+      continue;
+
+    case FS_DATA:
+      c = decode(f, b);
+
+      if (c == NO_CHAR) {
+        continue;
+      } else if (c == CANCELLED) {
+        EMIT(cancel_event(ctx, ev));
+      } else if (IS_ERROR(c)) {
+        EMIT(data_event(ctx, ev, c));
+      } else if (f->data_len == f->data_max) {
+        EMIT(data_event(ctx, ev, OUT_OF_SPACE));
+      }
+
+      // Always add, even if frameend, as CRC takes that into account...
+      f->data[f->data_len++] = ZVALUE(c);
+      f->crc = UPDATE_CRC(ctx, f->crc, ZVALUE(c));
+
+      if (IS_FIN(c)) {
+        f->frameend = ZVALUE(c);
+        f->state = FS_CRC;
+        f->count = 0;
+      }
+
+      continue;
+
+    case FS_CRC:
+      c = decode(f, b);
+
+      if (c == NO_CHAR) {
+        continue;
+      } else if (c == CANCELLED) {
+        EMIT(cancel_event(ctx, ev));
+      } else if (IS_ERROR(c)) {
+        EMIT(data_event(ctx, ev, c));
+      }
+
+      f->raw[f->count++] = ZVALUE(c);
+
+      if (f->count == (ctx->in_32bit_block ? 4 : 2)) {
+        EMIT(data_event(ctx, ev, finish_data(ctx)));
+      }
+
+      continue;
+
+    default:
+      zm_feed_reset_ctx(ctx);
+      continue;
+    }
+  }
+
+#undef EMIT
+
+  *len = pos;
+  ev->type = ZEV_NONE;
+  return ZEV_NONE;
+}
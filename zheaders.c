@@ -21,6 +21,7 @@
 #include "znumbers.h"
 #include "crc16.h"
 #include "crc32.h"
+#include "zcrc.h"
 
 void zm_calc_hdr_crc(ZHDR *hdr) {
   uint16_t crc = ucrc16(hdr->type, CRC_START_XMODEM);
@@ -33,18 +34,21 @@ void zm_calc_hdr_crc(ZHDR *hdr) {
   hdr->crc2 = CRC_LSB(crc);
 }
 
-uint16_t zm_calc_data_crc(uint8_t *buf, uint16_t len) {
-  uint16_t crc = CRC_START_XMODEM;
+void zm_calc_hdr_crc32(ZHDR *hdr) {
+  uint32_t crc = ~zm_crc32_update(CRC_START_32, (uint8_t*)hdr, 5);
 
-  for (int i = 0; i < len; i++) {
-    crc = ucrc16(buf[i], crc);
-  }
+  hdr->crc1 = CRC32_B1(crc);
+  hdr->crc2 = CRC32_B2(crc);
+  hdr->crc3 = CRC32_B3(crc);
+  hdr->crc4 = CRC32_B4(crc);
+}
 
-  return crc;
+uint16_t zm_calc_data_crc(uint8_t *buf, uint16_t len) {
+  return zm_crc16_update(CRC_START_XMODEM, buf, len);
 }
 
 uint32_t zm_calc_data_crc32(uint8_t *buf, uint16_t len) {
-  return crc32((char*)buf, len);
+  return ~zm_crc32_update(CRC_START_32, buf, len);
 }
 
 ZRESULT zm_to_hex_header(ZHDR *hdr, uint8_t *buf, int max_len) {
@@ -91,3 +95,89 @@ ZRESULT zm_check_header_crc32(ZHDR *hdr, uint32_t crc) {
 }
 
 
+
+/*
+ * Parse a number (in the given base) from block 0, stopping at a space
+ * or NUL. Returns OK, or UNSUPPORTED if there's nothing there.
+ */
+static ZRESULT parse_number(uint8_t **ptr, uint8_t *end, uint8_t base, uint32_t *value) {
+  uint8_t *p = *ptr;
+  uint32_t result = 0;
+
+  while (p < end && *p == ' ') {
+    p++;
+  }
+
+  if (p == end || *p < '0' || *p >= '0' + base) {
+    *ptr = p;
+    return UNSUPPORTED;
+  }
+
+  while (p < end && *p >= '0' && *p < '0' + base) {
+    uint8_t digit = *p++ - '0';
+
+    if (result > (0xffffffff - digit) / base) {
+      return OUT_OF_RANGE;
+    }
+
+    result = result * base + digit;
+  }
+
+  *ptr = p;
+  *value = result;
+  return OK;
+}
+
+ZRESULT zm_parse_file_info(uint8_t *buf, uint16_t len, ZFILEINFO *info) {
+  // Each field in order, with its base and flag
+  static const struct { uint8_t base; uint8_t flag; } fields[] = {
+    { 10, ZFI_SIZE },
+    {  8, ZFI_MTIME },
+    {  8, ZFI_MODE },
+    {  8, ZFI_SERIAL },
+    { 10, ZFI_FILES_LEFT },
+    { 10, ZFI_BYTES_LEFT },
+  };
+  uint32_t *values[] = {
+    &info->size, &info->mtime, &info->mode,
+    &info->serial, &info->files_left, &info->bytes_left
+  };
+  uint8_t *end = buf + len;
+  uint8_t *ptr = buf;
+
+  info->name = (const char*)buf;
+  info->present = 0;
+
+  while (ptr < end && *ptr) {
+    ptr++;
+  }
+
+  if (ptr == end) {
+    DEBUGF("PARSE_FILE_INFO: Name isn't terminated\n");
+    return CORRUPTED;
+  }
+
+  // Rest is space-separated, and ends with NUL (or the frame end)
+  end = ++ptr;
+
+  while (end < buf + len && *end) {
+    end++;
+  }
+
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    ZRESULT result = parse_number(&ptr, end, fields[i].base, values[i]);
+
+    if (result == OUT_OF_RANGE) {
+      return result;
+    } else if (result != OK) {
+      break;
+    }
+
+    info->present |= fields[i].flag;
+  }
+
+  DEBUGF("PARSE_FILE_INFO: '%s' (fields 0x%02x; size %lu)\n",
+         info->name, info->present, (unsigned long)info->size);
+
+  return OK;
+}
@@ -59,62 +59,22 @@ ZRESULT zm_hex_to_nybble(char c1) {
   }
 }
 
+static const uint8_t hex_digits[] = "0123456789abcdef";
+
 ZRESULT zm_nybble_to_hex(uint8_t nybble) {
-  switch (nybble) {
-  case 0x0:
-    return '0';
-  case 0x1:
-    return '1';
-  case 0x2:
-    return '2';
-  case 0x3:
-    return '3';
-  case 0x4:
-    return '4';
-  case 0x5:
-    return '5';
-  case 0x6:
-    return '6';
-  case 0x7:
-    return '7';
-  case 0x8:
-    return '8';
-  case 0x9:
-    return '9';
-  case 0xa:
-    return 'a';
-  case 0xb:
-    return 'b';
-  case 0xc:
-    return 'c';
-  case 0xd:
-    return 'd';
-  case 0xe:
-    return 'e';
-  case 0xf:
-    return 'f';
-  default:
+  if (nybble > 0x0f) {
     return OUT_OF_RANGE;
+  } else {
+    return hex_digits[nybble];
   }
 }
 
 ZRESULT zm_byte_to_hex(uint8_t byte, uint8_t *buf) {
-  uint16_t h1 = zm_nybble_to_hex(BMSN(byte));
+  // Both nybbles are always in range, so straight from the table
+  *buf++ = hex_digits[BMSN(byte)];
+  *buf = hex_digits[BLSN(byte)];
 
-  if (IS_ERROR(h1)) {
-    return h1;
-  } else {
-    uint16_t h2 = zm_nybble_to_hex(BLSN(byte));
-
-    if (IS_ERROR(h2)) {
-      return h2;
-    } else {
-      *buf++ = h1;
-      *buf = h2;
-
-      return OK;
-    }
-  }
+  return OK;
 }
 
 ZRESULT zm_hex_to_byte(unsigned char c1, unsigned char c2) {
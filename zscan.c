@@ -0,0 +1,132 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Bulk scanning routines for buffered receive
+ * ------------------------------------------------------------
+ */
+
+#include <stdbool.h>
+#ifndef ZEMBEDDED
+#include <string.h>
+#endif
+#include "ztypes.h"
+#include "zscan.h"
+
+/*
+ * Note that only the bare ZDLE / XON / XOFF need stopping for - the
+ * high-bit versions of XON / XOFF pass the NONCONTROL check in
+ * zm_read_escaped and come back unchanged like any other byte.
+ */
+static inline uint16_t scan_scalar(const uint8_t *buf, uint16_t pos, uint16_t len) {
+  while (pos < len && buf[pos] != ZDLE && buf[pos] != XON && buf[pos] != XOFF) {
+    pos++;
+  }
+
+  return pos;
+}
+
+#ifdef ZSCAN_SIMD
+#include <immintrin.h>
+
+/* XON (0x11) and XOFF (0x13) only differ in bit 1, so one compare does both */
+#define XONOFF_BIT    0x02
+
+static uint8_t scan_max = ZSCAN_SSE2, scan_level = ZSCAN_SSE2;
+
+__attribute__((constructor)) static void init_scan() {
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    scan_max = scan_level = ZSCAN_AVX2;
+  }
+}
+
+uint8_t zm_scan_level(uint8_t level) {
+  return scan_level = level < scan_max ? level : scan_max;
+}
+
+static uint16_t scan_sse2(const uint8_t *buf, uint16_t len) {
+  const __m128i zdle = _mm_set1_epi8(ZDLE);
+  const __m128i xoff = _mm_set1_epi8(XOFF);
+  const __m128i bit = _mm_set1_epi8(XONOFF_BIT);
+  uint16_t pos = 0;
+
+  while (len - pos >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + pos));
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, zdle),
+                               _mm_cmpeq_epi8(_mm_or_si128(v, bit), xoff));
+    int mask = _mm_movemask_epi8(hit);
+
+    if (mask) {
+      return pos + __builtin_ctz(mask);
+    }
+
+    pos += 16;
+  }
+
+  return scan_scalar(buf, pos, len);
+}
+
+__attribute__((target("avx2"))) static uint16_t scan_avx2(const uint8_t *buf, uint16_t len) {
+  const __m256i zdle = _mm256_set1_epi8(ZDLE);
+  const __m256i xoff = _mm256_set1_epi8(XOFF);
+  const __m256i bit = _mm256_set1_epi8(XONOFF_BIT);
+  uint16_t pos = 0;
+
+  while (len - pos >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(buf + pos));
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, zdle),
+                                  _mm256_cmpeq_epi8(_mm256_or_si256(v, bit), xoff));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+
+    if (mask) {
+      return pos + __builtin_ctz(mask);
+    }
+
+    pos += 32;
+  }
+
+  return scan_scalar(buf, pos, len);
+}
+
+uint16_t zm_scan_unescaped(const uint8_t *buf, uint16_t len) {
+  switch (scan_level) {
+  case ZSCAN_AVX2:
+    return scan_avx2(buf, len);
+  case ZSCAN_SSE2:
+    return scan_sse2(buf, len);
+  default:
+    return scan_scalar(buf, 0, len);
+  }
+}
+#else
+uint16_t zm_scan_unescaped(const uint8_t *buf, uint16_t len) {
+  return scan_scalar(buf, 0, len);
+}
+#endif
+
+#ifdef ZEMBEDDED
+uint16_t zm_scan_zdle(const uint8_t *buf, uint16_t len) {
+  uint16_t pos = 0;
+
+  while (pos < len && buf[pos] != ZDLE) {
+    pos++;
+  }
+
+  return pos;
+}
+#else
+uint16_t zm_scan_zdle(const uint8_t *buf, uint16_t len) {
+  // libc's memchr is already vectorised - no need for our own here
+  const uint8_t *hit = memchr(buf, ZDLE, len);
+  return hit ? (uint16_t)(hit - buf) : len;
+}
+#endif
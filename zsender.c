@@ -0,0 +1,779 @@
+/*
+ *------------------------------------------------------------
+ *                                  ___ ___ _
+ *  ___ ___ ___ ___ ___       _____|  _| . | |_
+ * |  _| . |_ -|  _| . |     |     | . | . | '_|
+ * |_| |___|___|___|___|_____|_|_|_|___|___|_,_|
+ *                     |_____|       firmware v1
+ * ------------------------------------------------------------
+ * Copyright (c)2020 Ross Bamford
+ * See top-level LICENSE.md for licence information.
+ *
+ * Sending side of the Zmodem implementation
+ * ------------------------------------------------------------
+ */
+
+#ifdef ZDEBUG
+#include <stdio.h>
+#endif
+
+#ifndef ZEMBEDDED
+#include <string.h>
+#else
+#include "embedded.h"
+#endif
+
+#include "zsender.h"
+#include "zserial.h"
+#include "zheaders.h"
+#include "zcrc.h"
+#include "zescape.h"
+
+#include "crc16.h"
+#include "crc32.h"
+
+static void set_pos(ZHDR *hdr, uint8_t type, uint32_t pos) {
+  hdr->type = type;
+#ifdef ZM_BIG_ENDIAN
+  hdr->position.p3 = (uint8_t)(pos & 0xff);
+  hdr->position.p2 = (uint8_t)(pos >> 8) & 0xff;
+  hdr->position.p1 = (uint8_t)(pos >> 16) & 0xff;
+  hdr->position.p0 = (uint8_t)(pos >> 24) & 0xff;
+#else
+  hdr->position.p0 = (uint8_t)(pos & 0xff);
+  hdr->position.p1 = (uint8_t)(pos >> 8) & 0xff;
+  hdr->position.p2 = (uint8_t)(pos >> 16) & 0xff;
+  hdr->position.p3 = (uint8_t)(pos >> 24) & 0xff;
+#endif
+}
+
+static uint32_t get_pos(ZHDR *hdr) {
+#ifdef ZM_BIG_ENDIAN
+  return (uint32_t)hdr->position.p3
+      | (uint32_t)hdr->position.p2 << 8
+      | (uint32_t)hdr->position.p1 << 16
+      | (uint32_t)hdr->position.p0 << 24;
+#else
+  return (uint32_t)hdr->position.p0
+      | (uint32_t)hdr->position.p1 << 8
+      | (uint32_t)hdr->position.p2 << 16
+      | (uint32_t)hdr->position.p3 << 24;
+#endif
+}
+
+/*
+ * Send a binary header - CRC32 if the receiver can do it, else CRC16.
+ */
+static ZRESULT send_bin_hdr(ZMCTX *ctx, ZHDR *hdr) {
+  DEBUG_DUMPHDR_P(hdr);
+
+  if (ctx->rx_caps & CANFC32) {
+    return zm_send_bin32_hdr_ctx(ctx, hdr);
+  } else {
+    return zm_send_bin16_hdr_ctx(ctx, hdr);
+  }
+}
+
+/*
+ * Send (part of) a data subpacket. Data is escaped and CRC'd in the
+ * same pass, ZDATA_BLOCK_LEN bytes at a time into a worst-case-sized
+ * buffer, so big subpackets don't need a big buffer. Start *crc off
+ * with crc_start; a subpacket can then be sent in as many pieces as
+ * you like, with frameend 0 for all but the last. The frame end and
+ * CRC go out with the last piece, so a subpacket of up to
+ * ZDATA_BLOCK_LEN goes to the transport in one go.
+ */
+static uint32_t crc_start(ZMCTX *ctx) {
+  return ctx->rx_caps & CANFC32 ? CRC_START_32 : CRC_START_XMODEM;
+}
+
+static ZRESULT send_data(ZMCTX *ctx, const uint8_t *data, uint16_t len, uint8_t frameend, uint32_t *crc) {
+  uint8_t out[ZSEND_BUF_LEN];
+  uint8_t crc_bytes[4];
+  uint8_t crc_len;
+  ZRESULT result;
+  uint16_t n;
+
+  while (len > ZDATA_BLOCK_LEN) {
+    n = zm_escape_crc_ctx(ctx, data, ZDATA_BLOCK_LEN, out, crc);
+
+    if (IS_ERROR(result = zm_send_raw_ctx(ctx, out, n))) {
+      return result;
+    }
+
+    data += ZDATA_BLOCK_LEN;
+    len -= ZDATA_BLOCK_LEN;
+  }
+
+  n = zm_escape_crc_ctx(ctx, data, len, out, crc);
+
+  if (!frameend) {
+    return n ? zm_send_raw_ctx(ctx, out, n) : OK;
+  }
+
+  // CRC includes the frame end
+  if (ctx->rx_caps & CANFC32) {
+    uint32_t c32 = ~ucrc32(frameend, *crc);
+
+    crc_bytes[0] = CRC32_B1(c32);
+    crc_bytes[1] = CRC32_B2(c32);
+    crc_bytes[2] = CRC32_B3(c32);
+    crc_bytes[3] = CRC32_B4(c32);
+    crc_len = 4;
+  } else {
+    uint16_t c16 = ucrc16(frameend, *crc);
+
+    crc_bytes[0] = CRC_MSB(c16);
+    crc_bytes[1] = CRC_LSB(c16);
+    crc_len = 2;
+  }
+
+  out[n++] = ZDLE;
+  out[n++] = ctx->esc_last = frameend;
+
+  n += zm_escape_ctx(ctx, crc_bytes, crc_len, out + n);
+
+  return zm_send_raw_ctx(ctx, out, n);
+}
+
+static void set_block_len(ZMCTX *ctx, uint16_t len) {
+  ZSTATS *stats = &ctx->stats;
+
+  DEBUGF("  >> SENDER: Subpacket size 0x%04x -> 0x%04x\n", ctx->block_len, len);
+
+  ctx->block_len = stats->block_len = len;
+  stats->history[stats->changes++ % ZSTATS_HISTORY] = len;
+}
+
+/*
+ * Subpacket size control. Every subpacket that goes out counts as
+ * clean until the receiver says otherwise; after ZGROW_AFTER of them
+ * the size doubles (up to the negotiated limit). A resend request or
+ * a ZNAK halves it, so the next error costs less to recover from.
+ */
+static void block_sent(ZMCTX *ctx, uint16_t len) {
+  ZSTATS *stats = &ctx->stats;
+
+  stats->data_bytes += len;
+  stats->subpackets++;
+
+  if (++stats->clean >= ZGROW_AFTER && ctx->block_len < ctx->block_limit) {
+    set_block_len(ctx, ctx->block_len > ctx->block_limit / 2 ? ctx->block_limit : ctx->block_len * 2);
+    stats->clean = 0;
+  }
+}
+
+static void block_shrink(ZMCTX *ctx) {
+  ctx->stats.clean = 0;
+
+  if (ctx->block_len > ZMIN_BLOCK_LEN) {
+    set_block_len(ctx, ctx->block_len / 2 < ZMIN_BLOCK_LEN ? ZMIN_BLOCK_LEN : ctx->block_len / 2);
+  }
+}
+
+static void block_failed(ZMCTX *ctx) {
+  ctx->stats.rpos++;
+  block_shrink(ctx);
+}
+
+static void block_naked(ZMCTX *ctx) {
+  ctx->stats.naks++;
+  block_shrink(ctx);
+}
+
+/*
+ * Block 0 for ZFILE - name, NUL, size in decimal, NUL.
+ */
+static ZRESULT file_info(const char *name, uint32_t size, uint8_t *buf, uint16_t max) {
+  uint16_t name_len = strlen(name);
+  uint8_t digits[10];
+  int count = 0;
+
+  do {
+    digits[count++] = '0' + (size % 10);
+    size /= 10;
+  } while (size);
+
+  if (name_len + count + 2 > max) {
+    return OUT_OF_SPACE;
+  }
+
+  for (uint16_t i = 0; i < name_len; i++) {
+    *buf++ = name[i];
+  }
+
+  *buf++ = 0;
+
+  for (int i = count - 1; i >= 0; i--) {
+    *buf++ = digits[i];
+  }
+
+  *buf = 0;
+
+  return name_len + count + 2;
+}
+
+ZRESULT zm_sender_begin_ctx(ZMCTX *ctx) {
+  ZHDR hdr;
+  ZRESULT result = zm_send_sz_ctx(ctx, (uint8_t*)"rz\r");
+
+  if (IS_ERROR(result)) {
+    return result;
+  }
+
+  for (int tries = 0; tries < ZSEND_RETRIES; tries++) {
+    if (IS_ERROR(result = zm_send_pos_hdr_ctx(ctx, ZRQINIT, 0))) {
+      return result;
+    }
+
+    result = zm_await_header_ctx(ctx, &hdr);
+
+    if (result == CANCELLED || result == CLOSED) {
+      return result;
+    } else if (result == OK && hdr.type == ZRINIT) {
+      ctx->rx_caps = hdr.flags.f0;
+      ctx->rx_buf_len = hdr.position.p0 | hdr.position.p1 << 8;
+      ctx->block_limit = hdr.flags.f1 & CAN8K ? ZBIG_BLOCK_LEN : ZDATA_BLOCK_LEN;
+
+      if (ctx->block_max && ctx->block_limit > ctx->block_max) {
+        ctx->block_limit = ctx->block_max;
+      }
+
+      if (ctx->rx_buf_len && ctx->block_limit > ctx->rx_buf_len) {
+        ctx->block_limit = ctx->rx_buf_len;
+      }
+
+      memset(&ctx->stats, 0, sizeof(ZSTATS));
+      ctx->block_len = ctx->stats.block_len = ctx->block_limit;
+
+      zm_escape_init_ctx(ctx);
+      DEBUGF("  >> SENDER: Got ZRINIT; Receiver flags are 0x%02x; Buffer is 0x%04x; Subpackets are 0x%04x byte(s)\n",
+             ctx->rx_caps, ctx->rx_buf_len, ctx->block_len);
+      return OK;
+    }
+
+    DEBUGF("  >> SENDER: Wanted ZRINIT, got [0x%04x] type 0x%02x\n", result, hdr.type);
+  }
+
+  return IS_ERROR(result) ? result : BAD_FRAME_TYPE;
+}
+
+/*
+ * CRC32 of the first len bytes of the file, for answering ZCRC. Uses
+ * buf as scratch when reading through the hook.
+ */
+static ZRESULT file_crc(uint32_t len, ZREADFN read, void *source, const uint8_t *mem,
+                        uint8_t *buf, uint32_t *crc) {
+  uint32_t pos = 0;
+  ZRESULT result;
+
+  *crc = CRC_START_32;
+
+  if (mem) {
+    *crc = ~zm_crc32_update(*crc, mem, len);
+    return OK;
+  }
+
+  while (pos < len) {
+    uint16_t count = len - pos < ZDATA_BLOCK_LEN ? len - pos : ZDATA_BLOCK_LEN;
+
+    if (IS_ERROR(result = read(source, pos, buf, &count))) {
+      return result;
+    } else if (count == 0) {
+      break;
+    }
+
+    *crc = zm_crc32_update(*crc, buf, count);
+    pos += count;
+  }
+
+  *crc = ~*crc;
+  return OK;
+}
+
+static void copy(uint8_t *dst, const uint8_t *src, uint32_t len) {
+#ifdef ZEMBEDDED
+  for (uint32_t i = 0; i < len; i++) {
+    dst[i] = src[i];
+  }
+#else
+  memcpy(dst, src, len);
+#endif
+}
+
+/*
+ * Keep file data that's just been read in the ring, if there is one.
+ * If it doesn't carry on from what's there, start the ring again.
+ */
+static void ring_put(ZRING *ring, uint32_t pos, const uint8_t *data, uint16_t len) {
+  uint32_t start, first;
+
+  if (!ring->buf) {
+    return;
+  } else if (pos != ring->end_pos) {
+    ring->fill = 0;
+    ring->end_pos = pos;
+  }
+
+  ring->end_pos += len;
+  ring->fill = ring->fill + len > ring->len ? ring->len : ring->fill + len;
+
+  // Only the last ring->len bytes are worth keeping
+  if (len > ring->len) {
+    data += len - ring->len;
+    pos += len - ring->len;
+    len = ring->len;
+  }
+
+  // Up to the end of the ring, then whatever's left from the start
+  start = pos % ring->len;
+  first = ring->len - start < len ? ring->len - start : len;
+
+  copy(ring->buf + start, data, first);
+  copy(ring->buf, data + first, len - first);
+}
+
+/*
+ * File data from pos from the ring, if it's there (NULL if not). len
+ * is cut down to what it has. Points straight into the ring if that
+ * bit doesn't wrap, else it's copied to buf.
+ */
+static const uint8_t* ring_get(ZRING *ring, uint32_t pos, uint16_t *len, uint8_t *buf) {
+  uint32_t start;
+
+  if (!ring->buf || pos < ring->end_pos - ring->fill || pos >= ring->end_pos) {
+    return NULL;
+  } else if (*len > ring->end_pos - pos) {
+    *len = ring->end_pos - pos;
+  }
+
+  start = pos % ring->len;
+
+  if (start + *len <= ring->len) {
+    return ring->buf + start;
+  }
+
+  // Wraps, so put the two halves back together
+  copy(buf, ring->buf + start, ring->len - start);
+  copy(buf + (ring->len - start), ring->buf, *len - (ring->len - start));
+
+  return buf;
+}
+
+/*
+ * Act on a header from the receiver while sending data. Returns OK to
+ * carry on, FIN | ZRPOS if it wants to go back (to the position in
+ * hdr), or an error.
+ */
+static ZRESULT data_reply(ZMCTX *ctx, uint32_t pos, uint32_t *acked, ZHDR *hdr) {
+  switch (hdr->type) {
+  case ZACK:
+    if (get_pos(hdr) > *acked && get_pos(hdr) <= pos) {
+      *acked = get_pos(hdr);
+    }
+
+    return OK;
+  case ZRPOS:
+    return FIN | ZRPOS;
+  case ZSKIP:
+    return SKIPPED;
+  case ZFIN:
+  case ZABORT:
+    return CANCELLED;
+  case ZNAK:
+    block_naked(ctx);
+    return OK;
+  default:
+    DEBUGF("  >> SENDER: Ignoring header type 0x%02x while sending\n", hdr->type);
+    return OK;
+  }
+}
+
+/*
+ * Between subpackets, act on anything the receiver has sent meanwhile
+ * (if the session has a peek hook), so a ZRPOS is seen straight away
+ * rather than at the next wait for the window or after ZEOF. Returns
+ * as data_reply.
+ */
+static ZRESULT check_replies(ZMCTX *ctx, uint32_t pos, uint32_t *acked, ZHDR *hdr) {
+  ZRESULT result;
+
+  while ((result = zm_poll_header_ctx(ctx, hdr)) != TIMEOUT) {
+    if (result == CANCELLED || result == CLOSED) {
+      return result;
+    } else if (result == OK && (result = data_reply(ctx, pos, acked, hdr)) != OK) {
+      return result;
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * Wait for ZACKs until less than limit bytes are unacknowledged - for
+ * the window, or (with limit 1 and ended set) after a ZCRCW. Returns
+ * OK once there's room, FIN | ZRPOS if the receiver wants to go back
+ * (to the position in hdr), or an error.
+ */
+static ZRESULT await_window(ZMCTX *ctx, uint32_t pos, uint32_t *acked, uint32_t limit,
+                            bool ended, ZHDR *hdr) {
+  ZRESULT result;
+  uint32_t crc;
+  int tries = 0;
+
+  while (pos - *acked >= limit) {
+    result = zm_await_header_ctx(ctx, hdr);
+
+    if (result == CANCELLED || result == CLOSED) {
+      return result;
+    } else if (result != OK) {
+      if (++tries == ZSEND_RETRIES) {
+        return result;
+      }
+
+      // Might have been the ZACK we're waiting for - an empty subpacket
+      // asks for another (in a new frame, if the last one was ended)
+      crc = crc_start(ctx);
+
+      if (ended) {
+        set_pos(hdr, ZDATA, pos);
+
+        if (IS_ERROR(result = send_bin_hdr(ctx, hdr))) {
+          return result;
+        }
+      }
+
+      if (IS_ERROR(result = send_data(ctx, NULL, 0, ended ? ZCRCW : ZCRCQ, &crc))) {
+        return result;
+      }
+
+      continue;
+    }
+
+    if ((result = data_reply(ctx, pos, acked, hdr)) != OK) {
+      return result;
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * Common to zm_send_file and zm_send_mem. If mem is set, subpackets
+ * are escaped straight out of it, and read / source are unused.
+ */
+static ZRESULT send_file(ZMCTX *ctx, const char *name, uint32_t size,
+                         ZREADFN read, void *source, const uint8_t *mem) {
+  uint8_t block[ZDATA_BLOCK_LEN];
+  uint32_t pos = 0;
+  ZHDR hdr;
+  ZRESULT result;
+  ZRESULT info_len = file_info(name, size, block, ZDATA_BLOCK_LEN);
+  uint32_t crc;
+  int tries, strays = 0;
+
+  if (IS_ERROR(info_len)) {
+    return info_len;
+  } else if (!ctx->block_len) {
+    // No zm_sender_begin (ZRINIT dealt with elsewhere), so stick to 1K
+    ctx->block_len = ctx->block_limit = ctx->stats.block_len = ZDATA_BLOCK_LEN;
+  }
+
+  ctx->ring.fill = ctx->ring.end_pos = 0;
+
+  // ZFILE, until the receiver tells us where to start
+  for (tries = 0; tries < ZSEND_RETRIES; tries++) {
+    hdr.type = ZFILE;
+    hdr.flags.f0 = ctx->file_conv ? ctx->file_conv : ZCBIN;
+    hdr.flags.f1 = hdr.flags.f2 = hdr.flags.f3 = 0;
+
+    // Block may have been used to answer ZCRC since last time
+    file_info(name, size, block, ZDATA_BLOCK_LEN);
+
+    crc = crc_start(ctx);
+
+    if (IS_ERROR(result = send_bin_hdr(ctx, &hdr))
+        || IS_ERROR(result = send_data(ctx, block, info_len, ZCRCW, &crc))) {
+      return result;
+    }
+
+await_rpos:
+    result = zm_await_header_ctx(ctx, &hdr);
+
+    if (result == CANCELLED || result == CLOSED) {
+      return result;
+    } else if (result == OK) {
+      if (hdr.type == ZRPOS) {
+        pos = get_pos(&hdr);
+        break;
+      } else if (hdr.type == ZSKIP) {
+        DEBUGF("  >> SENDER: Receiver skipped '%s'\n", name);
+        return SKIPPED;
+      } else if (hdr.type == ZFIN || hdr.type == ZABORT) {
+        return CANCELLED;
+      } else if (hdr.type == ZCRC) {
+        // Receiver wants to check what it already has (e.g. to resume)
+        uint32_t len = get_pos(&hdr);
+
+        // ...but not forever, if it never gets round to ZRPOS
+        if (++strays == ZSEND_STRAYS) {
+          DEBUGF("  >> SENDER: Too many ZCRC; Giving up\n");
+          return BAD_FRAME_TYPE;
+        }
+
+        if (len == 0 || len > size) {
+          len = size;
+        }
+
+        if (IS_ERROR(result = file_crc(len, read, source, mem, block, &crc))) {
+          return result;
+        }
+
+        DEBUGF("  >> SENDER: CRC of first 0x%08lx byte(s) is 0x%08lx\n",
+               (unsigned long)len, (unsigned long)crc);
+
+        set_pos(&hdr, ZCRC, crc);
+
+        if (IS_ERROR(result = send_bin_hdr(ctx, &hdr))) {
+          return result;
+        }
+
+        goto await_rpos;
+      }
+    }
+
+    DEBUGF("  >> SENDER: Wanted ZRPOS, got [0x%04x] type 0x%02x\n", result, hdr.type);
+  }
+
+  if (tries == ZSEND_RETRIES) {
+    return IS_ERROR(result) ? result : BAD_FRAME_TYPE;
+  }
+
+  while (true) {
+    uint32_t acked = pos, checked = pos;
+    bool last = false;
+
+    if (pos > size) {
+      pos = size;
+    }
+
+    DEBUGF("  >> SENDER: Streaming from 0x%08lx\n", (unsigned long)pos);
+
+    set_pos(&hdr, ZDATA, pos);
+
+    if (IS_ERROR(result = send_bin_hdr(ctx, &hdr))) {
+      return result;
+    }
+
+    while (!last) {
+      uint16_t block_len = ctx->block_len;
+      uint16_t sub_len = 0;
+      uint8_t frameend = 0;
+
+      if ((result = check_replies(ctx, pos, &acked, &hdr)) == OK && ctx->window) {
+        result = await_window(ctx, pos, &acked, ctx->window, false, &hdr);
+      }
+
+      if (result == (FIN | ZRPOS)) {
+        break;
+      } else if (result != OK) {
+        return result;
+      }
+
+      // Don't go past the end of the receiver's buffer
+      if (ctx->rx_buf_len && pos - acked + block_len > ctx->rx_buf_len) {
+        block_len = ctx->rx_buf_len - (pos - acked);
+      }
+
+      crc = crc_start(ctx);
+
+      // Through the hook, a big subpacket is read (and sent) a block at a time
+      do {
+        uint16_t len = block_len - sub_len;
+        const uint8_t *data = block;
+
+        if (mem) {
+          data = mem + pos;
+
+          if (size - pos < len) {
+            len = size - pos;
+          }
+        } else {
+          if (len > ZDATA_BLOCK_LEN) {
+            len = ZDATA_BLOCK_LEN;
+          }
+
+          // Going back over what we've already sent comes from the ring
+          if ((data = ring_get(&ctx->ring, pos, &len, block)) == NULL) {
+            data = block;
+
+            if (IS_ERROR(result = read(source, pos, block, &len))) {
+              return result;
+            }
+
+            ring_put(&ctx->ring, pos, block, len);
+          }
+        }
+
+        // Stop early if the file turns out to be shorter than we said
+        last = len == 0 || pos + len >= size;
+        sub_len += len;
+
+        if (last) {
+          frameend = ZCRCE;
+        } else if (ctx->rx_buf_len && pos + len - acked >= ctx->rx_buf_len) {
+          frameend = ZCRCW;
+        } else if (sub_len == block_len) {
+          frameend = ZCRCG;
+
+          // Windowed, ask for a ZACK every quarter window, and always
+          // before we'd have to stop and wait for one
+          if (ctx->window && (pos + len - checked >= ctx->window / 4
+                              || pos + len - acked >= ctx->window)) {
+            frameend = ZCRCQ;
+            checked = pos + len;
+          }
+        }
+
+        if (IS_ERROR(result = send_data(ctx, data, len, frameend, &crc))) {
+          return result;
+        }
+
+        pos += len;
+      } while (!last && sub_len < block_len);
+
+      block_sent(ctx, sub_len);
+
+      // Receiver's buffer is full, so wait for it to catch up
+      if (frameend == ZCRCW) {
+        result = await_window(ctx, pos, &acked, 1, true, &hdr);
+
+        if (result != OK && result != (FIN | ZRPOS)) {
+          return result;
+        }
+
+        break;
+      }
+    }
+
+    if (result == (FIN | ZRPOS)) {
+      block_failed(ctx);
+      pos = get_pos(&hdr);
+      DEBUGF("  >> SENDER: Got ZRPOS 0x%08lx in window\n", (unsigned long)pos);
+      continue;
+    } else if (!last) {
+      // Frame ended with ZCRCW and it's all ACKed - start another
+      continue;
+    }
+
+    // Then ZEOF, and see what the receiver made of it all
+    strays = 0;
+
+    for (tries = 0; tries < ZSEND_RETRIES; tries++) {
+      set_pos(&hdr, ZEOF, pos);
+
+      if (IS_ERROR(result = send_bin_hdr(ctx, &hdr))) {
+        return result;
+      }
+
+await:
+      result = zm_await_header_ctx(ctx, &hdr);
+
+      if (result == CANCELLED || result == CLOSED) {
+        return result;
+      } else if (result != OK) {
+        continue;
+      }
+
+      switch (hdr.type) {
+      case ZRINIT:
+        return OK;
+      case ZSKIP:
+        return SKIPPED;
+      case ZRPOS:
+        block_failed(ctx);
+        break;
+      case ZFIN:
+      case ZABORT:
+        return CANCELLED;
+      case ZNAK:
+        // Receiver didn't get ZEOF, so that's a try - send it again
+        block_naked(ctx);
+        continue;
+      default:
+        // ZACKs left over from the window. Past ZSEND_STRAYS of them, each
+        // one counts as a try and repeats ZEOF
+        if (++strays < ZSEND_STRAYS) {
+          goto await;
+        }
+
+        continue;
+      }
+
+      break;
+    }
+
+    if (tries == ZSEND_RETRIES) {
+      return IS_ERROR(result) ? result : BAD_FRAME_TYPE;
+    }
+
+    pos = get_pos(&hdr);
+    DEBUGF("  >> SENDER: Got ZRPOS 0x%08lx\n", (unsigned long)pos);
+  }
+}
+
+ZRESULT zm_send_file_ctx(ZMCTX *ctx, const char *name, uint32_t size, ZREADFN read, void *source) {
+  return send_file(ctx, name, size, read, source, NULL);
+}
+
+ZRESULT zm_send_mem_ctx(ZMCTX *ctx, const char *name, const uint8_t *data, uint32_t size) {
+  return send_file(ctx, name, size, NULL, NULL, data);
+}
+
+void zm_sender_window_ctx(ZMCTX *ctx, uint32_t window, uint8_t *ring, uint32_t ring_len) {
+  ctx->window = window;
+  ctx->ring.buf = ring_len ? ring : NULL;
+  ctx->ring.len = ring_len;
+  ctx->ring.fill = ctx->ring.end_pos = 0;
+}
+
+ZRESULT zm_sender_end_ctx(ZMCTX *ctx) {
+  ZHDR hdr;
+  ZRESULT result = OK;
+
+  for (int tries = 0; tries < ZSEND_RETRIES; tries++) {
+    if (IS_ERROR(result = zm_send_pos_hdr_ctx(ctx, ZFIN, 0))) {
+      return result;
+    }
+
+    result = zm_await_header_ctx(ctx, &hdr);
+
+    if (result == CANCELLED || result == CLOSED) {
+      return result;
+    } else if (result == OK && hdr.type == ZFIN) {
+      return zm_send_sz_ctx(ctx, (uint8_t*)"OO");
+    }
+  }
+
+  return IS_ERROR(result) ? result : BAD_FRAME_TYPE;
+}
+
+ZRESULT zm_sender_begin() {
+  return zm_sender_begin_ctx(zm_default_ctx());
+}
+
+ZRESULT zm_send_file(const char *name, uint32_t size, ZREADFN read, void *source) {
+  return zm_send_file_ctx(zm_default_ctx(), name, size, read, source);
+}
+
+ZRESULT zm_send_mem(const char *name, const uint8_t *data, uint32_t size) {
+  return zm_send_mem_ctx(zm_default_ctx(), name, data, size);
+}
+
+void zm_sender_window(uint32_t window, uint8_t *ring, uint32_t ring_len) {
+  zm_sender_window_ctx(zm_default_ctx(), window, ring, ring_len);
+}
+
+ZRESULT zm_sender_end() {
+  return zm_sender_end_ctx(zm_default_ctx());
+}
@@ -29,11 +29,139 @@
 
 #include "crc16.h"
 #include "crc32.h"
+#include "zcrc.h"
+#include "zscan.h"
+#include "zescape.h"
 
-static uint8_t in_32bit_block = 0;
+#ifdef ZBUFFERED
+static ZRESULT refill_window(ZMCTX *ctx) {
+  uint16_t len = ZRECV_WIN_LEN;
+  ZRESULT result = ctx->recv_buf(ctx->user, ctx->recv_win, &len);
 
-ZRESULT zm_read_crlf() {
-  uint16_t c = zm_read_escaped();//zm_recv();
+  ctx->recv_pos = ctx->recv_limit = 0;
+
+  if (IS_ERROR(result)) {
+    DEBUGF("  >> REFILL: Got error: 0x%04x\n", result);
+    return result;
+  } else if (len == 0) {
+    DEBUGF("  >> REFILL: Got no data; Closed\n");
+    return CLOSED;
+  } else {
+    TRACEF("  >> REFILL: Got %d byte(s)\n", len);
+    ctx->recv_limit = len;
+    return OK;
+  }
+}
+
+static inline ZRESULT recv_byte(ZMCTX *ctx) {
+  if (ctx->recv_pos == ctx->recv_limit) {
+    ZRESULT result = refill_window(ctx);
+
+    if (IS_ERROR(result)) {
+      return result;
+    }
+  }
+
+  return ctx->recv_win[ctx->recv_pos++];
+}
+
+/* Give back the byte recv_byte just returned - it's still in the window */
+static inline void unrecv_byte(ZMCTX *ctx, uint8_t c) {
+  (void)c;
+  ctx->recv_pos--;
+}
+
+static ZRESULT send_bytes(ZMCTX *ctx, const uint8_t *buf, uint16_t len) {
+  return ctx->send_buf(ctx->user, buf, len);
+}
+
+void zm_purge_ctx(ZMCTX *ctx) {
+  ctx->recv_pos = ctx->recv_limit = 0;
+}
+#else
+static inline ZRESULT recv_byte(ZMCTX *ctx) {
+  if (ctx->held) {
+    ZRESULT c = ZVALUE(ctx->held);
+    ctx->held = 0;
+    return c;
+  }
+
+  return ctx->recv(ctx->user);
+}
+
+static inline void unrecv_byte(ZMCTX *ctx, uint8_t c) {
+  ctx->held = OK | c;
+}
+
+static ZRESULT send_bytes(ZMCTX *ctx, const uint8_t *buf, uint16_t len) {
+  while (len--) {
+    ZRESULT result = ctx->send(ctx->user, *buf++);
+
+    if (IS_ERROR(result)) {
+      return result;
+    }
+  }
+
+  return OK;
+}
+
+void zm_purge_ctx(ZMCTX *ctx) {
+  ctx->held = 0;
+}
+#endif
+
+/*
+ * Note XON / XOFF from the other end, for send_raw.
+ */
+static inline void flow_byte(ZMCTX *ctx, uint8_t c) {
+  ctx->xoff = (c & 0x7f) == XOFF;
+}
+
+/*
+ * Hold off after XOFF until XON. Anything else means the other end is
+ * talking again, so that's put back for whoever reads next - as is a
+ * timeout, in case the XON went missing.
+ */
+static ZRESULT await_xon(ZMCTX *ctx) {
+  DEBUGF("Got XOFF; Waiting for XON\n");
+
+  while (ctx->xoff) {
+    ZRESULT c = recv_byte(ctx);
+
+    if (c == TIMEOUT) {
+      ctx->xoff = false;
+    } else if (IS_ERROR(c)) {
+      return c;
+    } else if ((c & 0x7f) == XON || (c & 0x7f) == XOFF) {
+      flow_byte(ctx, c);
+    } else {
+      unrecv_byte(ctx, c);
+      ctx->xoff = false;
+    }
+  }
+
+  return OK;
+}
+
+static ZRESULT send_raw(ZMCTX *ctx, const uint8_t *buf, uint16_t len) {
+  ZRESULT result;
+
+  if (ctx->xon_xoff && ctx->xoff && IS_ERROR(result = await_xon(ctx))) {
+    return result;
+  } else if (ctx->flow && IS_ERROR(result = ctx->flow(ctx->user))) {
+    return result;
+  }
+
+  return send_bytes(ctx, buf, len);
+}
+
+void zm_init_ctx(ZMCTX *ctx) {
+  memset(ctx, 0, sizeof(ZMCTX));
+  zm_escape_init_ctx(ctx);
+}
+
+ZRESULT zm_read_crlf_ctx(ZMCTX *ctx) {
+  uint16_t c = zm_read_escaped_ctx(ctx);//zm_recv();
 
   if (IS_ERROR(c)) {
     DEBUGF("CRLF: Got error on first character: 0x%04x\n", c);
@@ -43,7 +171,7 @@ ZRESULT zm_read_crlf() {
     return OK;
   } else if (c == CR || c == (CR | 0x80)) {
     TRACEF("CRLF: Got CR on first character, await LF\n");
-    c = zm_read_escaped(); //zm_recv();
+    c = zm_read_escaped_ctx(ctx); //zm_recv();
 
     if (IS_ERROR(c)) {
       return c;
@@ -61,13 +189,13 @@ ZRESULT zm_read_crlf() {
   }
 }
 
-ZRESULT zm_read_hex_byte() {
-  int c1 = zm_recv(), c2;
+ZRESULT zm_read_hex_byte_ctx(ZMCTX *ctx) {
+  int c1 = recv_byte(ctx), c2;
 
   if (IS_ERROR(c1)) {
     return c1;
   } else {
-    c2 = zm_recv();
+    c2 = recv_byte(ctx);
     if (IS_ERROR(c2)) {
       return c2;
     } else {
@@ -76,11 +204,11 @@ ZRESULT zm_read_hex_byte() {
   }
 }
 
-ZRESULT zm_read_escaped() {
+ZRESULT zm_read_escaped_ctx(ZMCTX *ctx) {
   ZRESULT c;
 
   while (true) {
-    c = zm_recv();
+    c = recv_byte(ctx);
 
     // Return immediately if non-control character or error
     if (NONCONTROL(c) || IS_ERROR(c)) {
@@ -99,6 +227,7 @@ ZRESULT zm_read_escaped() {
     case XOFF:
     case XOFF | 0x80:
       TRACEF("  >> READ_ESCAPED: Skipped XON/XOFF\n");
+      flow_byte(ctx, c);
       continue;
     case ZDLE:
       TRACEF("  >> READ_ESCAPED: Got ZDLE\n");
@@ -159,13 +288,13 @@ ZRESULT zm_read_escaped() {
    *          so is either protocol control, or an escaped character.
    *
    */
-  if (IS_ERROR(c = zm_recv()))
+  if (IS_ERROR(c = recv_byte(ctx)))
     return c;
-  if (c == CAN && IS_ERROR(c = zm_recv()))
+  if (c == CAN && IS_ERROR(c = recv_byte(ctx)))
     return c;
-  if (c == CAN && IS_ERROR(c = zm_recv()))
+  if (c == CAN && IS_ERROR(c = recv_byte(ctx)))
     return c;
-  if (c == CAN && IS_ERROR(c = zm_recv()))
+  if (c == CAN && IS_ERROR(c = recv_byte(ctx)))
     return c;
 
   switch (c) {
@@ -201,13 +330,57 @@ ZRESULT zm_read_escaped() {
   return BAD_ESCAPE;
 }
 
-/* Just read a data block - no CRC checking is done; see read_data_block */
-static ZRESULT recv_data_block(uint8_t *buf, uint16_t *len) {
+/* Update the running CRC for the current block type with one byte */
+#define UPDATE_CRC(ctx, crc, c)   ((ctx)->in_32bit_block ? (uint32_t)ucrc32((c), (crc)) \
+                                                         : (uint16_t)ucrc16((c), (crc)))
+
+/*
+ * Just read a data block - no CRC checking is done; see read_data_block.
+ *
+ * The CRC is updated as we go (including the frame end) so it doesn't
+ * need another pass over the data once the block is in.
+ */
+static ZRESULT recv_data_block(ZMCTX *ctx, uint8_t *buf, uint16_t *len, uint32_t *crc) {
   uint16_t max = *len;
   *len = 0;
 
   while (*len < max) {
-    ZRESULT c = zm_read_escaped();
+#ifdef ZBUFFERED
+    // Copy any run of plain bytes straight out of the window
+    uint8_t *src = ctx->recv_win + ctx->recv_pos;
+    uint8_t *dst = buf + *len;
+    uint16_t avail = ctx->recv_limit - ctx->recv_pos;
+
+    if (avail > max - *len) {
+      avail = max - *len;
+    }
+
+    uint16_t run = zm_scan_unescaped(src, avail);
+
+#ifdef ZEMBEDDED
+    for (uint16_t i = 0; i < run; i++) {
+      dst[i] = src[i];
+    }
+#else
+    memcpy(dst, src, run);
+#endif
+
+    // ... and CRC it while it's still in cache
+    if (ctx->in_32bit_block) {
+      *crc = zm_crc32_update(*crc, dst, run);
+    } else {
+      *crc = zm_crc16_update(*crc, dst, run);
+    }
+
+    ctx->recv_pos += run;
+    *len += run;
+
+    if (*len == max) {
+      break;
+    }
+#endif
+
+    ZRESULT c = zm_read_escaped_ctx(ctx);
 
     if (IS_ERROR(c)) {
       DEBUGF("  >> RECV_BLOCK: GOT ERROR: 0x%04x\n", c);
@@ -215,6 +388,7 @@ static ZRESULT recv_data_block(uint8_t *buf, uint16_t *len) {
     } else {
       // Always add, even if frameend, as CRC takes that into account...
       buf[(*len)++] = ZVALUE(c);
+      *crc = UPDATE_CRC(ctx, *crc, ZVALUE(c));
 
       if (IS_FIN(c)) {
         return c;
@@ -225,43 +399,44 @@ static ZRESULT recv_data_block(uint8_t *buf, uint16_t *len) {
   return OUT_OF_SPACE;
 }
 
-ZRESULT zm_read_data_block(uint8_t *buf, uint16_t *len) {
-  DEBUGF("  >> READ_BLOCK: Reading %d-bit block\n", in_32bit_block ? 32 : 16);
-  ZRESULT result = recv_data_block(buf, len);
+ZRESULT zm_read_data_block_ctx(ZMCTX *ctx, uint8_t *buf, uint16_t *len) {
+  DEBUGF("  >> READ_BLOCK: Reading %d-bit block\n", ctx->in_32bit_block ? 32 : 16);
+  uint32_t calc_crc = ctx->in_32bit_block ? CRC_START_32 : CRC_START_XMODEM;
+  ZRESULT result = recv_data_block(ctx, buf, len, &calc_crc);
   DEBUGF("  >> READ_BLOCK: Result of data block recv is [0x%04x] (got %d character(s))\n", result, *len);
 
   if (IS_ERROR(result)) {
     return result;
   } else {
     // CRC bytes are ZDLE escaped!
-    ZRESULT crc1 = zm_read_escaped();
+    ZRESULT crc1 = zm_read_escaped_ctx(ctx);
     if (IS_ERROR(crc1)) {
       DEBUGF("  >> READ_BLOCK: Error while reading crc1: 0x%04x\n", crc1);
       return crc1;
     }
 
-    ZRESULT crc2 = zm_read_escaped();
+    ZRESULT crc2 = zm_read_escaped_ctx(ctx);
     if (IS_ERROR(crc2)) {
       return crc2;
       DEBUGF("  >> READ_BLOCK: Error while reading crc2: 0x%04x\n", crc2);
     }
 
-    if (in_32bit_block) {
-      ZRESULT crc3 = zm_read_escaped();
+    if (ctx->in_32bit_block) {
+      ZRESULT crc3 = zm_read_escaped_ctx(ctx);
       if (IS_ERROR(crc3)) {
         return crc3;
         DEBUGF("  >> READ_BLOCK: Error while reading crc3: 0x%04x\n", crc3);
       }
 
-      ZRESULT crc4 = zm_read_escaped();
+      ZRESULT crc4 = zm_read_escaped_ctx(ctx);
       if (IS_ERROR(crc4)) {
         return crc4;
         DEBUGF("  >> READ_BLOCK: Error while reading crc4: 0x%04x\n", crc4);
       }
 
-      DEBUGF("  >> READ_BLOCK: Calculate CRC32 for block len: %d\n", *len);
+      DEBUGF("  >> READ_BLOCK: Check CRC32 for block len: %d\n", *len);
       uint32_t recv_crc = CRC32(ZVALUE(crc1), ZVALUE(crc2), ZVALUE(crc3), ZVALUE(crc4));
-      uint32_t calc_crc = zm_calc_data_crc32(buf, *len);
+      calc_crc = ~calc_crc;
 
       if (recv_crc == calc_crc) {
         DEBUGF("  >> READ_BLOCK: CRC32 is good (recv: 0x%08x; calc: 0x%08x)\n", recv_crc, calc_crc);
@@ -271,9 +446,8 @@ ZRESULT zm_read_data_block(uint8_t *buf, uint16_t *len) {
         return BAD_CRC;
       }
     } else {
-      DEBUGF("  >> READ_BLOCK: Calculate CRC16 for block len: %d\n", *len);
+      DEBUGF("  >> READ_BLOCK: Check CRC16 for block len: %d\n", *len);
       uint16_t recv_crc = CRC(ZVALUE(crc1), ZVALUE(crc2));
-      uint16_t calc_crc = zm_calc_data_crc(buf, *len);
 
       if (recv_crc == calc_crc) {
         DEBUGF("  >> READ_BLOCK: CRC is good (recv: 0x%04x; calc: 0x%04x)\n", recv_crc, calc_crc);
@@ -287,12 +461,12 @@ ZRESULT zm_read_data_block(uint8_t *buf, uint16_t *len) {
 }
 
 
-ZRESULT zm_await(char *str, char *buf, int buf_size) {
+ZRESULT zm_await_ctx(ZMCTX *ctx, char *str, char *buf, int buf_size) {
   memset(buf, 0, 4);
   int ptr = 0;
 
   while(true) {
-    ZRESULT c = zm_read_escaped();
+    ZRESULT c = zm_read_escaped_ctx(ctx);
 
     if (IS_ERROR(c)) {
       return c;
@@ -324,9 +498,35 @@ ZRESULT zm_await(char *str, char *buf, int buf_size) {
   }
 }
 
-ZRESULT zm_await_zdle() {
+/*
+ * Count n more junk bytes against the session's garbage_max.
+ */
+static inline bool too_much_garbage(ZMCTX *ctx, uint32_t *junk, uint16_t n) {
+  *junk += n;
+  return ctx->garbage_max && *junk > ctx->garbage_max;
+}
+
+/*
+ * Skip to the next ZDLE. Everything skipped (ZPADs included) goes in
+ * junk, which is kept by the caller for the whole header wait.
+ */
+static ZRESULT await_zdle(ZMCTX *ctx, uint32_t *junk) {
   while (true) {
-    int c = zm_recv();
+#ifdef ZBUFFERED
+    // Skip anything already in the window in one go (stopping at XON /
+    // XOFF too, so they're seen)
+    uint16_t avail = ctx->recv_limit - ctx->recv_pos;
+    uint16_t skip = zm_scan_unescaped(ctx->recv_win + ctx->recv_pos, avail);
+
+    ctx->recv_pos += skip;
+
+    if (too_much_garbage(ctx, junk, skip)) {
+      DEBUGF("Too much garbage (%lu byte(s))\n", (unsigned long)*junk);
+      return TOO_MUCH_GARBAGE;
+    }
+#endif
+
+    int c = recv_byte(ctx);
 
     if (IS_ERROR(c)) {
       DEBUGF("Got error :(\n");
@@ -336,14 +536,15 @@ ZRESULT zm_await_zdle() {
       case ZPAD:
       case ZPAD | 0200:
         TRACEF("Got ZPAD...\n");
-        continue;
+        break;
       case ZDLE:
         TRACEF("Got ZDLE\n");
         return OK;
       case XON:
       case XOFF:
         TRACEF("Got XON/XOFF\n");
-        continue;
+        flow_byte(ctx, c);
+        break;
       default:
 #ifdef ZDEBUG
         DEBUGF("Got unknown (0x%02x)", c);
@@ -353,25 +554,35 @@ ZRESULT zm_await_zdle() {
           DEBUGF(" [CTL]\n");
         }
 #endif
-        continue;
+        break;
+      }
+
+      if (too_much_garbage(ctx, junk, 1)) {
+        DEBUGF("Too much garbage (%lu byte(s))\n", (unsigned long)*junk);
+        return TOO_MUCH_GARBAGE;
       }
     }
   }
 }
 
-ZRESULT zm_read_hex_header(ZHDR *hdr) {
+ZRESULT zm_await_zdle_ctx(ZMCTX *ctx) {
+  uint32_t junk = 0;
+  return await_zdle(ctx, &junk);
+}
+
+ZRESULT zm_read_hex_header_ctx(ZMCTX *ctx, ZHDR *hdr) {
   uint8_t *ptr = (uint8_t*)hdr;
   memset(hdr, 0xc0, sizeof(ZHDR));
   uint16_t crc = CRC_START_XMODEM;
 
   // Set flag that next block will be CRC16
-  in_32bit_block = 0;
+  ctx->in_32bit_block = 0;
 
   // TODO maybe don't treat header as a stream of bytes, which would remove
   //      the need to have the all-byte layout in ZHDR struct...
   for (int i = 0; i < ZHDR_SIZE - 2; i++) {
     // TODO use read_hex_byte here...
-    uint16_t c1 = zm_recv();
+    uint16_t c1 = recv_byte(ctx);
 
     if (IS_ERROR(c1)) {
       DEBUGF("READ_HEX: Character %d/1 is error: 0x%04x\n", i, c1);
@@ -381,7 +592,7 @@ ZRESULT zm_read_hex_header(ZHDR *hdr) {
       return CLOSED;
     } else {
       TRACEF("READ_HEX: Character %d/1 is good: 0x%04x\n", i, c1);
-      uint16_t c2 = zm_recv();
+      uint16_t c2 = recv_byte(ctx);
 
       if (IS_ERROR(c2)) {
         DEBUGF("READ_HEX: Character %d/2 is error: 0x%04x\n", i, c2);
@@ -421,16 +632,16 @@ ZRESULT zm_read_hex_header(ZHDR *hdr) {
   return zm_check_header_crc16(hdr, crc);
 }
 
-ZRESULT zm_read_binary16_header(ZHDR *hdr) {
+ZRESULT zm_read_binary16_header_ctx(ZMCTX *ctx, ZHDR *hdr) {
   uint8_t *ptr = (uint8_t*)hdr;
   memset(hdr, 0xc0, sizeof(ZHDR));
   uint16_t crc = CRC_START_XMODEM;
 
   // Set flag that next block will be CRC16
-  in_32bit_block = 0;
+  ctx->in_32bit_block = 0;
 
   for (int i = 0; i < ZHDR_SIZE - 2; i++) {
-    uint16_t b = zm_read_escaped();
+    uint16_t b = zm_read_escaped_ctx(ctx);
 
     if (IS_ERROR(b)) {
       DEBUGF("READ_BIN16: Character %d/1 is error: 0x%04x\n", i, b);
@@ -457,16 +668,16 @@ ZRESULT zm_read_binary16_header(ZHDR *hdr) {
   return zm_check_header_crc16(hdr, crc);
 }
 
-ZRESULT zm_read_binary32_header(ZHDR *hdr) {
+ZRESULT zm_read_binary32_header_ctx(ZMCTX *ctx, ZHDR *hdr) {
   uint8_t *ptr = (uint8_t*)hdr;
   memset(hdr, 0xc0, sizeof(ZHDR));
   uint32_t crc = CRC_START_32;
 
   // Set flag that next block will be CRC32
-  in_32bit_block = 1;
+  ctx->in_32bit_block = 1;
 
   for (int i = 0; i < ZHDR_SIZE; i++) {
-    uint16_t b = zm_read_escaped();
+    uint16_t b = zm_read_escaped_ctx(ctx);
 
     if (IS_ERROR(b)) {
       DEBUGF("READ_BIN32: Character %d/1 is error: 0x%04x\n", i, b);
@@ -498,70 +709,213 @@ ZRESULT zm_read_binary32_header(ZHDR *hdr) {
   return zm_check_header_crc32(hdr, crc);
 }
 
-ZRESULT zm_await_header(ZHDR *hdr) {
+/*
+ * Read the rest of a header once the frame type (after ZPAD ZDLE) is in.
+ */
+static ZRESULT read_header(ZMCTX *ctx, uint8_t frame_type, ZHDR *hdr) {
   uint16_t result;
 
+  switch (frame_type) {
+  case ZHEX:
+    DEBUGF("Reading HEX header\n");
+    result = zm_read_hex_header_ctx(ctx, hdr);
+
+    if (result == OK) {
+      DEBUGF("Got valid header\n");
+      return zm_read_crlf_ctx(ctx);
+    } else {
+      DEBUGF("Didn't get valid header [0x%02x]\n", result);
+      return result;
+    }
+  case ZBIN16:
+    DEBUGF("Reading BIN16 header\n");
+    result = zm_read_binary16_header_ctx(ctx, hdr);
+
+    if (result == OK) {
+      DEBUGF("Got valid header\n");
+
+      if (ctx->peer_hdr != ZBIN32) {
+        ctx->peer_hdr = ZBIN16;
+      }
+
+      return OK;
+    } else {
+      DEBUGF("Didn't get valid header [0x%02x]\n", result);
+      return result;
+    }
+  case ZBIN32:
+      DEBUGF("Reading BIN32 header\n");
+      result = zm_read_binary32_header_ctx(ctx, hdr);
+
+      if (result == OK) {
+        DEBUGF("Got valid header\n");
+        ctx->peer_hdr = ZBIN32;
+        return OK;
+      } else {
+        DEBUGF("Didn't get valid header [0x%02x]\n", result);
+        return result;
+      }
+  default:
+    DEBUGF("Got bad frame type '%c' [%02x]\n", frame_type, frame_type);
+    return BAD_FRAME_TYPE;
+  }
+}
+
+ZRESULT zm_await_header_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  ZRESULT result;
+  uint32_t junk = 0;
+
   while (true) {
-    if (zm_await_zdle() == OK) {
+    if ((result = await_zdle(ctx, &junk)) == OK) {
       DEBUGF("Got ZDLE, awaiting type...\n");
-      ZRESULT frame_type = zm_read_escaped();
+      ZRESULT frame_type = zm_read_escaped_ctx(ctx);
 
-      if (IS_ERROR(frame_type)) {
+      if (frame_type == TIMEOUT) {
+        return TIMEOUT;
+      } else if (IS_ERROR(frame_type)) {
           DEBUGF("Got error reading frame type: 0x%04x\n", frame_type);
+
+          if (too_much_garbage(ctx, &junk, 1)) {
+            return TOO_MUCH_GARBAGE;
+          }
+
           continue;
       }
 
-      switch (ZVALUE(frame_type)) {
-      case ZHEX:
-        DEBUGF("Reading HEX header\n");
-        result = zm_read_hex_header(hdr);
+      if ((result = read_header(ctx, ZVALUE(frame_type), hdr)) == OK) {
+        ctx->timeouts = 0;
+      }
 
-        if (result == OK) {
-          DEBUGF("Got valid header\n");
-          return zm_read_crlf();
-        } else {
-          DEBUGF("Didn't get valid header [0x%02x]\n", result);
-          return result;
-        }
-      case ZBIN16:
-        DEBUGF("Reading BIN16 header\n");
-        result = zm_read_binary16_header(hdr);
+      return result;
+    } else {
+      return result == TIMEOUT || result == TOO_MUCH_GARBAGE ? result : CLOSED;
+    }
+  }
+}
 
-        if (result == OK) {
-          DEBUGF("Got valid header\n");
-          return OK;
-        } else {
-          DEBUGF("Didn't get valid header [0x%02x]\n", result);
-          return result;
-        }
-      case ZBIN32:
-          DEBUGF("Reading BIN32 header\n");
-          result = zm_read_binary32_header(hdr);
+/*
+ * Anything from the other end that hasn't been read yet? Only the
+ * session's peek hook can say for sure.
+ */
+static bool input_waiting(ZMCTX *ctx) {
+#ifdef ZBUFFERED
+  if (ctx->recv_pos < ctx->recv_limit) {
+    return true;
+  }
+#else
+  if (ctx->held) {
+    return true;
+  }
+#endif
 
-          if (result == OK) {
-            DEBUGF("Got valid header\n");
-            return OK;
-          } else {
-            DEBUGF("Didn't get valid header [0x%02x]\n", result);
-            return result;
-          }
-      default:
-        DEBUGF("Got bad frame type '%c' [%02x]\n", ZVALUE(frame_type), ZVALUE(frame_type));
-        return BAD_FRAME_TYPE;
+  return ctx->peek(ctx->user);
+}
+
+ZRESULT zm_poll_header_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  if (!ctx->peek) {
+    return TIMEOUT;
+  }
+
+  while (input_waiting(ctx)) {
+    ZRESULT c = recv_byte(ctx);
+
+    if (IS_ERROR(c)) {
+      return c;
+    } else if (c == ZPAD || c == ZDLE) {
+      // Something's started - the rest won't be far behind
+      unrecv_byte(ctx, c);
+      return zm_await_header_ctx(ctx, hdr);
+    } else if ((c & 0x7f) == XON || (c & 0x7f) == XOFF) {
+      flow_byte(ctx, c);
+    }
+  }
+
+  return TIMEOUT;
+}
+
+/*
+ * Errors from the link itself, rather than noise on it.
+ */
+static inline bool link_error(ZRESULT result) {
+  return result == CANCELLED || result == CLOSED || result == TIMEOUT;
+}
+
+/*
+ * Skip to the next ZPAD ZDLE - a ZDLE on its own is just escaped data,
+ * unless there are five of them (i.e. CANs) in a row.
+ */
+static ZRESULT await_zpad_zdle(ZMCTX *ctx) {
+  bool pad = false;
+  int cans = 0;
+
+  while (true) {
+#ifdef ZBUFFERED
+    // Skip straight to the next ZDLE in the window
+    uint16_t skip = zm_scan_zdle(ctx->recv_win + ctx->recv_pos, ctx->recv_limit - ctx->recv_pos);
+
+    if (skip) {
+      ctx->recv_pos += skip;
+      pad = ctx->recv_win[ctx->recv_pos - 1] == ZPAD || ctx->recv_win[ctx->recv_pos - 1] == (ZPAD | 0200);
+      cans = 0;
+    }
+#endif
+
+    ZRESULT c = recv_byte(ctx);
+
+    if (IS_ERROR(c)) {
+      return c;
+    } else if (c == ZDLE) {
+      if (pad) {
+        return OK;
+      } else if (++cans == 5) {
+        DEBUGF("Got five CANs\n");
+        return CANCELLED;
       }
     } else {
-      return CLOSED;
+      cans = 0;
     }
+
+    pad = c == ZPAD || c == (ZPAD | 0200);
   }
 }
 
-ZRESULT zm_send_sz(uint8_t *data) {
-  register uint16_t result;
+ZRESULT zm_read_zsinit_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  uint8_t buf[ZATTNLEN + 1];
+  uint16_t len = sizeof(buf);
+  ZRESULT result = zm_read_data_block_ctx(ctx, buf, &len);
 
-  while (*data) {
-    result = zm_send(*data++);
+  if (IS_ERROR(result)) {
+    DEBUGF("Bad ZSINIT data: 0x%04x\n", result);
+    return result;
+  }
 
-    if (IS_ERROR(result)) {
+  // Last byte is the frame end; the sender should have NUL-terminated
+  // the rest, but make sure
+  for (int i = 0; i < ZATTNLEN; i++) {
+    ctx->attn[i] = i < len - 1 ? buf[i] : 0;
+  }
+
+  ctx->attn[ZATTNLEN - 1] = 0;
+
+  // TESCCTL / TESC8 are the same bits as ESCCTL / ESC8, and say what
+  // we should escape in what we send back
+  ctx->rx_caps = (ctx->rx_caps & ~(ESCCTL | ESC8)) | (hdr->flags.f0 & (TESCCTL | TESC8));
+  zm_escape_init_ctx(ctx);
+
+  DEBUGF("Got ZSINIT; Flags 0x%02x\n", hdr->flags.f0);
+
+  return zm_send_pos_hdr_ctx(ctx, ZACK, 0);
+}
+
+ZRESULT zm_send_attn_ctx(ZMCTX *ctx) {
+  ZRESULT result;
+
+  for (uint8_t *p = ctx->attn; *p; p++) {
+    if (*p == ATTNBRK || *p == ATTNPSE) {
+      if (ctx->attn_sig && IS_ERROR(result = ctx->attn_sig(ctx->user, *p))) {
+        return result;
+      }
+    } else if (IS_ERROR(result = send_raw(ctx, p, 1))) {
       return result;
     }
   }
@@ -569,78 +923,320 @@ ZRESULT zm_send_sz(uint8_t *data) {
   return OK;
 }
 
-static ZRESULT just_send_hex_hdr(uint8_t *buf) {
-  zm_send(ZPAD);
-  zm_send(ZPAD);
-  zm_send(ZDLE);
+ZRESULT zm_resync_ctx(ZMCTX *ctx, uint32_t pos, ZHDR *hdr) {
+  ZRESULT result;
 
-  DEBUGF("  >> SEND (raw): [%s]\n", buf);
+  DEBUGF("Resyncing at 0x%08lx\n", (unsigned long)pos);
 
-  ZRESULT result = zm_send_sz(buf);
-  if (IS_ERROR(result)) {
+  // Stop the sender first, if it told us how
+  if ((result = zm_send_attn_ctx(ctx)) != OK || (result = zm_send_pos_hdr_ctx(ctx, ZRPOS, pos)) != OK) {
+    return result;
+  }
+
+  while (true) {
+    if (IS_ERROR(result = await_zpad_zdle(ctx))) {
       return result;
-  } else {
-      return zm_send(XON);
+    }
+
+    ZRESULT frame_type = zm_read_escaped_ctx(ctx);
+
+    if (link_error(frame_type)) {
+      return frame_type;
+    } else if (IS_ERROR(frame_type)) {
+      continue;
+    }
+
+    result = read_header(ctx, ZVALUE(frame_type), hdr);
+
+    if (link_error(result)) {
+      return result;
+    } else if (result != OK) {
+      // Probably more of the old frame - no point complaining about it
+      continue;
+    }
+
+    uint32_t at = BTODW(hdr->position.p0, hdr->position.p1, hdr->position.p2, hdr->position.p3);
+
+    // ZEOF too - the sender got to the end before it saw the ZRPOS, but
+    // it will once it starts waiting for ZRINIT. Sending another would
+    // just make it go back twice.
+    if ((hdr->type == ZDATA || hdr->type == ZEOF) && at != pos) {
+      DEBUGF("Skipping header [0x%02x] at 0x%08lx\n", hdr->type, (unsigned long)at);
+      continue;
+    }
+
+    ctx->timeouts = 0;
+    return OK;
   }
 }
 
-ZRESULT zm_send_hex_hdr(ZHDR *hdr) {
-  static uint8_t buf[HEX_HDR_STR_LEN];
+ZRESULT zm_timeout_ctx(ZMCTX *ctx) {
+  uint16_t budget = ctx->timeout_budget ? ctx->timeout_budget : ZTIMEOUT_BUDGET;
+
+  if (++ctx->timeouts > budget) {
+    DEBUGF("Timed out %d time(s); Giving up\n", ctx->timeouts - 1);
+    return TIMEOUT;
+  }
+
+  // Back off - only resend after 1, 2, 4, 8... in a row (and only if
+  // there's been a ZRINIT / ZRPOS to resend)
+  if ((ctx->timeouts & (ctx->timeouts - 1)) == 0
+      && (ctx->retry_hdr.type == ZRINIT || ctx->retry_hdr.type == ZRPOS)) {
+    DEBUGF("Timed out %d time(s); Sending header [0x%02x] again\n", ctx->timeouts, ctx->retry_hdr.type);
+    return zm_send_hdr_ctx(ctx, &ctx->retry_hdr);
+  }
+
+  return OK;
+}
+
+ZRESULT zm_send_sz_ctx(ZMCTX *ctx, uint8_t *data) {
+  return send_raw(ctx, data, strlen((char*)data));
+}
+
+ZRESULT zm_send_raw_ctx(ZMCTX *ctx, const uint8_t *buf, uint16_t len) {
+  return send_raw(ctx, buf, len);
+}
+
+ZRESULT zm_send_hex_hdr_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  uint8_t *buf = ctx->hex_buf;
 
   zm_calc_hdr_crc(hdr);
-  ZRESULT result = zm_to_hex_header(hdr, buf, HEX_HDR_STR_LEN);
+  ZRESULT result = zm_to_hex_header(hdr, buf + 3, HEX_HDR_STR_LEN);
 
   if (IS_ERROR(result)) {
     return result;
   } else {
-    return just_send_hex_hdr(buf);
+    // Whole frame goes out in one go: ZPAD ZPAD ZDLE <hex header> XON
+    buf[0] = ZPAD;
+    buf[1] = ZPAD;
+    buf[2] = ZDLE;
+    buf[HEX_HDR_FRAME_LEN - 1] = XON;
+
+    DEBUGF("  >> SEND (raw): [%.*s]\n", HEX_HDR_STR_LEN, buf + 3);
+
+    return send_raw(ctx, buf, HEX_HDR_FRAME_LEN);
   }
+}
+
+/*
+ * Binary headers are ZPAD ZDLE <type> then the escaped header and CRC,
+ * so 10 bytes for a typical ZBIN32 ack against 21 for hex.
+ */
+static ZRESULT send_bin_hdr(ZMCTX *ctx, ZHDR *hdr, uint8_t frame_type, uint8_t len) {
+  uint8_t buf[3 + ZESCAPED_MAX(ZHDR_SIZE)];
+  uint8_t *ptr = buf;
+
+  *ptr++ = ZPAD;
+  *ptr++ = ZDLE;
+  *ptr++ = frame_type;
+
+  ptr += zm_escape_ctx(ctx, (uint8_t*)hdr, len, ptr);
 
+  DEBUGF("  >> SEND: Binary header (%s)\n", frame_type == ZBIN32 ? "CRC32" : "CRC16");
+
+  return send_raw(ctx, buf, ptr - buf);
 }
 
-ZRESULT zm_send_pos_hdr(uint8_t type, uint32_t pos) {
-  static ZHDR hdr;
+ZRESULT zm_send_bin16_hdr_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  zm_calc_hdr_crc(hdr);
+  return send_bin_hdr(ctx, hdr, ZBIN16, ZHDR_SIZE - 2);
+}
 
-#ifdef ZDEBUG
-  static const ZHDR* hdrptr = &hdr;
-#endif
+ZRESULT zm_send_bin32_hdr_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  zm_calc_hdr_crc32(hdr);
+  return send_bin_hdr(ctx, hdr, ZBIN32, ZHDR_SIZE);
+}
 
-  hdr.type = type;
+ZRESULT zm_send_hdr_ctx(ZMCTX *ctx, ZHDR *hdr) {
+  // What the receiver says again if the line goes quiet (zm_timeout)
+  if (hdr->type == ZRINIT || hdr->type == ZRPOS) {
+    ctx->retry_hdr = *hdr;
+  }
+
+  switch (ctx->peer_hdr) {
+  case ZBIN32:
+    return zm_send_bin32_hdr_ctx(ctx, hdr);
+  case ZBIN16:
+    return zm_send_bin16_hdr_ctx(ctx, hdr);
+  default:
+    return zm_send_hex_hdr_ctx(ctx, hdr);
+  }
+}
+
+ZRESULT zm_send_pos_hdr_ctx(ZMCTX *ctx, uint8_t type, uint32_t pos) {
+  ZHDR *hdr = &ctx->hdr;
+
+  hdr->type = type;
 #ifdef ZM_BIG_ENDIAN
-  hdr.position.p3 = (uint8_t)(pos & 0xff);
-  hdr.position.p2 = (uint8_t)(pos >> 8) & 0xff;
-  hdr.position.p1 = (uint8_t)(pos >> 16) & 0xff;
-  hdr.position.p0 = (uint8_t)(pos >> 24) & 0xff;
+  hdr->position.p3 = (uint8_t)(pos & 0xff);
+  hdr->position.p2 = (uint8_t)(pos >> 8) & 0xff;
+  hdr->position.p1 = (uint8_t)(pos >> 16) & 0xff;
+  hdr->position.p0 = (uint8_t)(pos >> 24) & 0xff;
 #else
-  hdr.position.p0 = (uint8_t)(pos & 0xff);
-  hdr.position.p1 = (uint8_t)(pos >> 8) & 0xff;
-  hdr.position.p2 = (uint8_t)(pos >> 16) & 0xff;
-  hdr.position.p3 = (uint8_t)(pos >> 24) & 0xff;
+  hdr->position.p0 = (uint8_t)(pos & 0xff);
+  hdr->position.p1 = (uint8_t)(pos >> 8) & 0xff;
+  hdr->position.p2 = (uint8_t)(pos >> 16) & 0xff;
+  hdr->position.p3 = (uint8_t)(pos >> 24) & 0xff;
 #endif
 
-  DEBUGF("Sending position header as hex; Dump is:\n");
-  DEBUG_DUMPHDR_P(hdrptr);
+  DEBUGF("Sending position header; Dump is:\n");
+  DEBUG_DUMPHDR_P(hdr);
 
-  return zm_send_hex_hdr(&hdr);
+  return zm_send_hdr_ctx(ctx, hdr);
 }
 
-ZRESULT zm_send_flags_hdr(uint8_t type, uint8_t f0, uint8_t f1, uint8_t f2, uint8_t f3) {
-  static ZHDR hdr;
+ZRESULT zm_send_flags_hdr_ctx(ZMCTX *ctx, uint8_t type, uint8_t f0, uint8_t f1, uint8_t f2, uint8_t f3) {
+  ZHDR *hdr = &ctx->hdr;
 
-#ifdef ZDEBUG
-  static const ZHDR* hdrptr = &hdr;
+  hdr->type = type;
+  hdr->flags.f0 = f0;
+  hdr->flags.f1 = f1;
+  hdr->flags.f2 = f2;
+  hdr->flags.f3 = f3;
+
+  DEBUGF("Sending flags header; Dump is:\n");
+  DEBUG_DUMPHDR_F(hdr);
+
+  return zm_send_hdr_ctx(ctx, hdr);
+}
+
+ZRESULT zm_send_zrinit_ctx(ZMCTX *ctx, uint8_t flags, uint8_t flags1, uint16_t buf_len) {
+  // ZP0 / ZP1 share bytes with ZF3 / ZF2
+  return zm_send_flags_hdr_ctx(ctx, ZRINIT, flags, flags1, (uint8_t)(buf_len >> 8), (uint8_t)(buf_len & 0xff));
+}
+
+/*
+ * Non-reentrant API - these all share a single session that talks
+ * to the link through the application-provided hooks.
+ */
+#ifdef ZBUFFERED
+static ZRESULT default_recv_buf(void *user, uint8_t *buf, uint16_t *len) {
+  return zm_recv_buf(buf, len);
+}
+
+static ZRESULT default_send_buf(void *user, const uint8_t *buf, uint16_t len) {
+  return zm_send_buf(buf, len);
+}
+
+static ZMCTX default_ctx = {
+  .recv_buf = default_recv_buf,
+  .send_buf = default_send_buf
+};
+#else
+static ZRESULT default_recv(void *user) {
+  return zm_recv();
+}
+
+static ZRESULT default_send(void *user, uint8_t chr) {
+  return zm_send(chr);
+}
+
+static ZMCTX default_ctx = {
+  .recv = default_recv,
+  .send = default_send
+};
 #endif
 
-  hdr.type = type;
-  hdr.flags.f0 = f0;
-  hdr.flags.f1 = f1;
-  hdr.flags.f2 = f2;
-  hdr.flags.f3 = f3;
+ZMCTX* zm_default_ctx() {
+  return &default_ctx;
+}
 
-  DEBUGF("Sending flags header as hex; Dump is:\n");
-  DEBUG_DUMPHDR_F(hdrptr);
+void zm_purge() {
+  zm_purge_ctx(&default_ctx);
+}
 
-  return zm_send_hex_hdr(&hdr);
+ZRESULT zm_read_crlf() {
+  return zm_read_crlf_ctx(&default_ctx);
+}
+
+ZRESULT zm_read_hex_byte() {
+  return zm_read_hex_byte_ctx(&default_ctx);
+}
+
+ZRESULT zm_read_escaped() {
+  return zm_read_escaped_ctx(&default_ctx);
 }
 
+ZRESULT zm_await(char *str, char *buf, int buf_size) {
+  return zm_await_ctx(&default_ctx, str, buf, buf_size);
+}
+
+ZRESULT zm_await_zdle() {
+  return zm_await_zdle_ctx(&default_ctx);
+}
+
+ZRESULT zm_await_header(ZHDR *hdr) {
+  return zm_await_header_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_poll_header(ZHDR *hdr) {
+  return zm_poll_header_ctx(&default_ctx, hdr);
+}
 
+ZRESULT zm_timeout() {
+  return zm_timeout_ctx(&default_ctx);
+}
+
+ZRESULT zm_read_zsinit(ZHDR *hdr) {
+  return zm_read_zsinit_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_send_attn() {
+  return zm_send_attn_ctx(&default_ctx);
+}
+
+ZRESULT zm_resync(uint32_t pos, ZHDR *hdr) {
+  return zm_resync_ctx(&default_ctx, pos, hdr);
+}
+
+ZRESULT zm_read_hex_header(ZHDR *hdr) {
+  return zm_read_hex_header_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_read_binary16_header(ZHDR *hdr) {
+  return zm_read_binary16_header_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_read_binary32_header(ZHDR *hdr) {
+  return zm_read_binary32_header_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_read_data_block(uint8_t *buf, uint16_t *len) {
+  return zm_read_data_block_ctx(&default_ctx, buf, len);
+}
+
+ZRESULT zm_send_sz(uint8_t *data) {
+  return zm_send_sz_ctx(&default_ctx, data);
+}
+
+ZRESULT zm_send_raw(const uint8_t *buf, uint16_t len) {
+  return zm_send_raw_ctx(&default_ctx, buf, len);
+}
+
+ZRESULT zm_send_hex_hdr(ZHDR *hdr) {
+  return zm_send_hex_hdr_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_send_bin16_hdr(ZHDR *hdr) {
+  return zm_send_bin16_hdr_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_send_bin32_hdr(ZHDR *hdr) {
+  return zm_send_bin32_hdr_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_send_hdr(ZHDR *hdr) {
+  return zm_send_hdr_ctx(&default_ctx, hdr);
+}
+
+ZRESULT zm_send_pos_hdr(uint8_t type, uint32_t pos) {
+  return zm_send_pos_hdr_ctx(&default_ctx, type, pos);
+}
+
+ZRESULT zm_send_flags_hdr(uint8_t type, uint8_t f0, uint8_t f1, uint8_t f2, uint8_t f3) {
+  return zm_send_flags_hdr_ctx(&default_ctx, type, f0, f1, f2, f3);
+}
+
+ZRESULT zm_send_zrinit(uint8_t flags, uint8_t flags1, uint16_t buf_len) {
+  return zm_send_zrinit_ctx(&default_ctx, flags, flags1, buf_len);
+}